@@ -19,16 +19,24 @@
 
 #include <math.h>
 #include "bitmapbuffer.h"
+#include "bitmapcache.h"
+#include "glyphcache.h"
+#include "truetypefont.h"
+#include "textlayout.h"
 #include "libopenui_depends.h"
 #include "libopenui_helpers.h"
 #include "libopenui_file.h"
 #include "font.h"
 #include "file_reader.h"
+#include "blit_kernels.h"
 #include "intconversions.h"
 
+uint32_t BitmapBuffer::lastGeneration = 0;
+
 BitmapBuffer::BitmapBuffer(uint8_t format, uint16_t width, uint16_t height):
   BitmapBufferBase<uint16_t>(format, width, height, nullptr),
-  dataAllocated(true)
+  dataAllocated(true),
+  generation(++lastGeneration)
 {
   data = (uint16_t *) malloc(align32(width * height * sizeof(uint16_t)));
   dataEnd = data + (width * height);
@@ -36,7 +44,8 @@ BitmapBuffer::BitmapBuffer(uint8_t format, uint16_t width, uint16_t height):
 
 BitmapBuffer::BitmapBuffer(uint8_t format, uint16_t width, uint16_t height, uint16_t * data):
   BitmapBufferBase<uint16_t>(format, width, height, data),
-  dataAllocated(false)
+  dataAllocated(false),
+  generation(++lastGeneration)
 {
 }
 
@@ -47,9 +56,103 @@ BitmapBuffer::~BitmapBuffer()
   }
 }
 
+// The pixels of a bitmap seen in the destination orientation of drawBitmap()
+// and drawMask(): the pixel (x, y) of the view is at origin + x * xStep + y * yStep
+template <class T>
+struct PixelView
+{
+  const T * origin;
+  int xStep;
+  int yStep;
+
+  PixelView(const T * data, const PixelLayout & layout, coord_t width, coord_t height, BitmapTransform transform):
+    origin(data + layout.getOffset(transform & BMP_FLIP_HORIZONTAL ? width - 1 : 0, transform & BMP_FLIP_VERTICAL ? height - 1 : 0)),
+    xStep(transform & BMP_FLIP_HORIZONTAL ? -layout.xStep : layout.xStep),
+    yStep(transform & BMP_FLIP_VERTICAL ? -layout.yStep : layout.yStep)
+  {
+    if (transform & BMP_TRANSPOSE) {
+      std::swap(xStep, yStep);
+    }
+  }
+
+  [[nodiscard]] PixelIterator<const T> getRow(coord_t x, coord_t y) const
+  {
+    return {origin + x * xStep + y * yStep, xStep};
+  }
+};
+
+// Converts a rect of a width x height bitmap to the coordinates of its view
+static void transformRect(BitmapTransform transform, coord_t width, coord_t height, coord_t & x, coord_t & y, coord_t & w, coord_t & h)
+{
+  if (transform & BMP_FLIP_HORIZONTAL) {
+    x = width - x - w;
+  }
+  if (transform & BMP_FLIP_VERTICAL) {
+    y = height - y - h;
+  }
+  if (transform & BMP_TRANSPOSE) {
+    std::swap(x, y);
+    std::swap(w, h);
+  }
+}
+
+// Floor of n / d, for d > 0
+constexpr int floorDiv(int n, int d)
+{
+  return n >= 0 ? n / d : -((-n + d - 1) / d);
+}
+
+// Average of the w x h source pixels at (x, y), in the SRC format
+template <class SRC, class T>
+static pixel_t averagePixels(const T * bmp, coord_t x, coord_t y, coord_t w, coord_t h)
+{
+  uint32_t sums[4] = {};
+  for (coord_t i = 0; i < h; i++) {
+    auto q = bmp->getRow(x, y + i);
+    for (coord_t j = 0; j < w; j++, ++q) {
+      SRC::accumulate(sums, *q);
+    }
+  }
+  return SRC::average(sums, w * h);
+}
+
+template <class DEST, class SRC>
+void BitmapBuffer::drawPixelsLine(PixelIterator<pixel_t> p, const pixel_t * line, coord_t count)
+{
+  if (p.step == 1) {
+    blitAlphaBitmapSpan(p.pixel, DEST::hasAlpha, line, SRC::hasAlpha, count);
+  }
+  else if constexpr (SRC::hasAlpha) {
+    // gather the destination pixels so that the blending kernel can be used
+    pixel_t tmp[BLIT_LINE_CHUNK];
+    for (coord_t i = 0; i < count; i++) {
+      tmp[i] = p[i];
+    }
+    blitAlphaBitmapSpan(tmp, DEST::hasAlpha, line, true, count);
+    for (coord_t i = 0; i < count; i++) {
+      p[i] = tmp[i];
+    }
+  }
+  else {
+    for (coord_t i = 0; i < count; i++, ++p) {
+      *p = PixelPainter<DEST, SRC>::draw(*p, line[i]);
+    }
+  }
+}
+
+template <class DEST, class SRC>
+void BitmapBuffer::drawPixelsRun(PixelIterator<pixel_t> p, pixel_t value, coord_t count)
+{
+  if constexpr (SRC::hasAlpha)
+    blendPixels(p, count, SRC::getAlpha(value), SRC::toRGB565(value));
+  else
+    fillPixels(p, count, PixelPainter<DEST, SRC>::draw(0, value));
+}
+
 template<class T>
-void BitmapBuffer::drawBitmap(coord_t x, coord_t y, const T * bmp, coord_t srcx, coord_t srcy, coord_t srcw, coord_t srch, float scale)
+void BitmapBuffer::drawBitmap(coord_t x, coord_t y, const T * bmp, coord_t srcx, coord_t srcy, coord_t srcw, coord_t srch, float scale, BitmapFilter filter, BitmapTransform transform)
 {
+  nextGeneration();
   if (!data || !bmp)
     return;
 
@@ -70,6 +173,10 @@ void BitmapBuffer::drawBitmap(coord_t x, coord_t y, const T * bmp, coord_t srcx,
   if (srcy + srch > bmph)
     srch = bmph - srcy;
 
+  // from here the source rect is given in the view coordinates
+  PixelView<pixel_t> view(bmp->getData(), bmp->getPixelLayout(), bmpw, bmph, transform);
+  transformRect(transform, bmpw, bmph, srcx, srcy, srcw, srch);
+
   if (scale == 0) {
     if (x < xmin) {
       srcw += x - xmin;
@@ -92,10 +199,39 @@ void BitmapBuffer::drawBitmap(coord_t x, coord_t y, const T * bmp, coord_t srcx,
       return;
     }
 
-    if (bmp->getFormat() == BMP_ARGB4444 || format == BMP_ARGB4444)
-      DMACopyAlphaBitmap(data, format == BMP_ARGB4444, _width, _height, x, y, bmp->getData(), bmp->getFormat() == BMP_ARGB4444, bmpw, bmph, srcx, srcy, srcw, srch);
-    else
-      DMACopyBitmap(data, _width, _height, x, y, bmp->getData(), bmpw, bmph, srcx, srcy, srcw, srch);
+    if (transform == BMP_TRANSFORM_NONE) {
+      if (bmp->getFormat() == BMP_ARGB4444 || format == BMP_ARGB4444)
+        DMACopyAlphaBitmap(data, format == BMP_ARGB4444, _width, _height, x, y, bmp->getData(), bmp->getFormat() == BMP_ARGB4444, bmpw, bmph, srcx, srcy, srcw, srch);
+      else
+        DMACopyBitmap(data, _width, _height, x, y, bmp->getData(), bmpw, bmph, srcx, srcy, srcw, srch);
+      return;
+    }
+
+    // the bitmap is transformed while it is copied, the pixels with alpha
+    // go through drawPixelsLine() to be blended
+    if (bmp->getFormat() == BMP_RGB565 && format == BMP_RGB565) {
+      blitCopyBlock(getPixelPtrAbs(x, y), layout.xStep, layout.yStep, view.getRow(srcx, srcy).pixel, view.xStep, view.yStep, srcw, srch);
+      return;
+    }
+
+    dispatchPixelFormat(format, [&](auto destFormat) {
+      dispatchPixelFormat(bmp->getFormat(), [&](auto srcFormat) {
+        using DEST = decltype(destFormat);
+        using SRC = decltype(srcFormat);
+        pixel_t line[BLIT_LINE_CHUNK];
+        for (int i = 0; i < srch; i++) {
+          auto p = getRow(x, y + i);
+          auto q = view.getRow(srcx, srcy + i);
+          for (int j = 0; j < srcw; j += BLIT_LINE_CHUNK) {
+            int count = min<int>(BLIT_LINE_CHUNK, srcw - j);
+            for (int k = 0; k < count; k++) {
+              line[k] = q[j + k];
+            }
+            drawPixelsLine<DEST, SRC>(p + j, line, count);
+          }
+        }
+      });
+    });
   }
   else {
     if (x < xmin) {
@@ -127,105 +263,468 @@ void BitmapBuffer::drawBitmap(coord_t x, coord_t y, const T * bmp, coord_t srcx,
     if (y + scaledh > _height)
       scaledh = _height - y;
 
-    if (format == BMP_ARGB4444)  {
-      for (int i = 0; i < scaledh; i++) {
-        pixel_t * p = getPixelPtrAbs(x, y + i);
-        const pixel_t * qstart = bmp->getPixelPtrAbs(srcx, srcy + int(i / scale));
-        for (int j = 0; j < scaledw; j++) {
-          const pixel_t * q = qstart;
-          q = bmp->getNextPixel(q, j / scale);
-          if (bmp->getFormat() == BMP_RGB565) {
-            RGB_SPLIT(*q, r, g, b);
-            drawPixel(p, ARGB_JOIN(0xF, r>>1, g>>2, b>>1));
-          }
-          else {  // bmp->getFormat() == BMP_ARGB4444
-            drawPixel(p, *q);
-          }
-          p = getNextPixel(p);
-        }
-      }
-    }
-    else {
-      for (int i = 0; i < scaledh; i++) {
-        pixel_t * p = getPixelPtrAbs(x, y + i);
-        const pixel_t * qstart = bmp->getPixelPtrAbs(srcx, srcy + int(i / scale));
-        for (int j = 0; j < scaledw; j++) {
-          const pixel_t * q = qstart;
-          q = bmp->getNextPixel(q, j / scale);
-          if (bmp->getFormat() == BMP_ARGB4444) {
-            ARGB_SPLIT(*q, a, r, g, b);
-            drawAlphaPixel(p, a, RGB_JOIN(r<<1, g<<2, b<<1));
+    // distance between two destination pixels in the source, in 16.16 fixed
+    // point, rounded up so that integer ratios land exactly on source pixels
+    auto step = uint32_t(ceilf(float(1 << 16) / scale));
+    bool boxFilter = (filter == BMP_FILTER_BOX && step > (1 << 16));
+
+    dispatchPixelFormat(format, [&](auto destFormat) {
+      dispatchPixelFormat(bmp->getFormat(), [&](auto srcFormat) {
+        using DEST = decltype(destFormat);
+        using SRC = decltype(srcFormat);
+        pixel_t line[BLIT_LINE_CHUNK];
+        coord_t columns[BLIT_LINE_CHUNK + 1];
+        for (int j = 0; j < scaledw; j += BLIT_LINE_CHUNK) {
+          int count = min<int>(BLIT_LINE_CHUNK, scaledw - j);
+          // the source columns of this chunk are the same for all the rows,
+          // the last entry is the end of the last box
+          for (int k = 0; k <= count; k++) {
+            columns[k] = min<coord_t>(k < count ? srcw - 1 : srcw, ((j + k) * step) >> 16);
           }
-          else {
-            drawPixel(p, *q);
+          uint32_t position = 0;
+          for (int i = 0; i < scaledh; i++, position += step) {
+            coord_t row = min<coord_t>(srch - 1, position >> 16);
+            if (boxFilter) {
+              coord_t rows = max<coord_t>(1, min<coord_t>(srch, (position + step) >> 16) - row);
+              for (int k = 0; k < count; k++) {
+                coord_t cols = max<coord_t>(1, columns[k + 1] - columns[k]);
+                line[k] = averagePixels<SRC>(&view, srcx + columns[k], srcy + row, cols, rows);
+              }
+            }
+            else {
+              auto q = view.getRow(srcx, srcy + row);
+              for (int k = 0; k < count; k++) {
+                line[k] = q[columns[k]];
+              }
+            }
+            drawPixelsLine<DEST, SRC>(getRow(x + j, y + i), line, count);
           }
-          p = getNextPixel(p);
         }
-      }
-    }
+      });
+    });
   }
 }
 
-template void BitmapBuffer::drawBitmap(coord_t, coord_t, BitmapBufferBase<const pixel_t> const *, coord_t, coord_t, coord_t, coord_t, float);
-template void BitmapBuffer::drawBitmap(coord_t, coord_t, const BitmapBuffer *, coord_t, coord_t, coord_t, coord_t, float);
-template void BitmapBuffer::drawBitmap(coord_t, coord_t, const RLEBitmap *, coord_t, coord_t, coord_t, coord_t, float);
+template void BitmapBuffer::drawBitmap(coord_t, coord_t, BitmapBufferBase<const pixel_t> const *, coord_t, coord_t, coord_t, coord_t, float, BitmapFilter, BitmapTransform);
+template void BitmapBuffer::drawBitmap(coord_t, coord_t, const BitmapBuffer *, coord_t, coord_t, coord_t, coord_t, float, BitmapFilter, BitmapTransform);
+template void BitmapBuffer::drawBitmap(coord_t, coord_t, const RLEBitmap *, coord_t, coord_t, coord_t, coord_t, float, BitmapFilter, BitmapTransform);
 
 template<class T>
-void BitmapBuffer::drawScaledBitmap(const T * bitmap, coord_t x, coord_t y, coord_t w, coord_t h)
+void BitmapBuffer::drawScaledBitmap(const T * bitmap, coord_t x, coord_t y, coord_t w, coord_t h, BitmapFilter filter)
 {
+  nextGeneration();
   if (bitmap) {
     auto scale = bitmap->getScale(w, h);
     int xshift = (w - (bitmap->width() * scale)) / 2;
     int yshift = (h - (bitmap->height() * scale)) / 2;
-    drawBitmap(x + xshift, y + yshift, bitmap, 0, 0, 0, 0, scale);
+    auto scaled = scaledBitmapCache.get(bitmap, w, h, filter);
+    if (scaled)
+      drawBitmap(x + xshift, y + yshift, scaled);
+    else
+      drawBitmap(x + xshift, y + yshift, bitmap, 0, 0, 0, 0, scale, filter);
   }
 }
 
-template void BitmapBuffer::drawScaledBitmap(const BitmapBuffer *, coord_t, coord_t, coord_t, coord_t);
+template void BitmapBuffer::drawScaledBitmap(const BitmapBuffer *, coord_t, coord_t, coord_t, coord_t, BitmapFilter);
 
-void BitmapBuffer::drawAlphaPixel(pixel_t * p, uint8_t alpha, Color565 color)
+// Narrows [first, last) to the steps k for which 0 <= start + k * step < limit
+static void clipSteps(int32_t start, int32_t step, int32_t limit, coord_t & first, coord_t & last)
+{
+  if (step > 0) {
+    first = max<coord_t>(first, -floorDiv(start, step));
+    last = min<coord_t>(last, floorDiv(limit - 1 - start, step) + 1);
+  }
+  else if (step < 0) {
+    first = max<coord_t>(first, -floorDiv(limit - 1 - start, -step));
+    last = min<coord_t>(last, floorDiv(start, -step) + 1);
+  }
+  else if (start < 0 || start >= limit) {
+    last = first;
+  }
+}
+
+BitmapRotation::BitmapRotation(float radians, coord_t width, coord_t height, bool bilinear):
+  bilinear(bilinear),
+  width(width)
+{
+  auto cosine = int32_t(lroundf(cosf(radians) * (1 << 16)));
+  auto sine = int32_t(lroundf(sinf(radians) * (1 << 16)));
+  dx = cosine;
+  dy = -sine;
+
+  // the source position of the destination pixel (0, 0), rounded to the
+  // nearest pixel by the shift when the pixels are not interpolated
+  coord_t x0 = width / 2;
+  coord_t y0 = height / 2;
+  int32_t rounding = bilinear ? 0 : 1 << 15;
+  originX = (x0 << 16) - x0 * cosine - y0 * sine + rounding;
+  originY = (y0 << 16) - y0 * cosine + x0 * sine + rounding;
+
+  // the interpolation reads up to the last column and row
+  limitX = bilinear ? ((width - 1) << 16) + 1 : width << 16;
+  limitY = bilinear ? ((height - 1) << 16) + 1 : height << 16;
+}
+
+BitmapRotation::Row BitmapRotation::getRow(coord_t row) const
+{
+  // going down one row is a rotation of the step
+  Row result = {0, width, originX - row * dy, originY + row * dx};
+  clipSteps(result.x, dx, limitX, result.first, result.last);
+  clipSteps(result.y, dy, limitY, result.first, result.last);
+  if (result.last <= result.first) {
+    result.first = result.last = 0;
+  }
+  return result;
+}
+
+template<class T>
+void BitmapBuffer::drawRotatedBitmap(coord_t x, coord_t y, const T * bmp, float radians, BitmapFilter filter)
+{
+  nextGeneration();
+  if (!data || !bmp)
+    return;
+
+  APPLY_OFFSET();
+
+  coord_t w = bmp->width();
+  coord_t h = bmp->height();
+
+  // the rows and columns of the rect which are inside the clipping rect
+  coord_t top = max<coord_t>(0, ymin - y);
+  coord_t bottom = min<coord_t>(h, ymax - y);
+  coord_t left = max<coord_t>(0, xmin - x);
+  coord_t right = min<coord_t>(w, xmax - x);
+  if (left >= right)
+    return;
+
+  BitmapRotation rotation(radians, w, h, filter == BMP_FILTER_BILINEAR);
+
+  dispatchPixelFormat(format, [&](auto destFormat) {
+    dispatchPixelFormat(bmp->getFormat(), [&](auto srcFormat) {
+      using DEST = decltype(destFormat);
+      using SRC = decltype(srcFormat);
+      pixel_t line[BLIT_LINE_CHUNK];
+      for (coord_t i = top; i < bottom; i++) {
+        auto row = rotation.getRow(i);
+        coord_t first = max(left, row.first);
+        coord_t last = min(right, row.last);
+        for (coord_t j = first; j < last; j += BLIT_LINE_CHUNK) {
+          coord_t count = min<coord_t>(BLIT_LINE_CHUNK, last - j);
+          bmp->samplePixels(line, row.x + j * rotation.dx, row.y + j * rotation.dy, rotation.dx, rotation.dy, count, rotation.bilinear);
+          drawPixelsLine<DEST, SRC>(getRow(x + j, y + i), line, count);
+        }
+      }
+    });
+  });
+}
+
+template void BitmapBuffer::drawRotatedBitmap(coord_t, coord_t, const Bitmap *, float, BitmapFilter);
+template void BitmapBuffer::drawRotatedBitmap(coord_t, coord_t, const BitmapBuffer *, float, BitmapFilter);
+template void BitmapBuffer::drawRotatedBitmap(coord_t, coord_t, const RLEBitmap *, float, BitmapFilter);
+
+// The lines of the encoded bitmaps, in the order of the LCD layout: rows, or
+// columns when the LCD is rotated
+class EncodedLines
+{
+  public:
+    EncodedLines(coord_t width, coord_t height)
+    {
+      auto encoded = PixelLayout::lcd(width, height);
+      rows = (encoded.xStep == 1 || encoded.xStep == -1);
+      length = rows ? width : height;
+      count = rows ? height : width;
+      innerStep = rows ? encoded.xStep : encoded.yStep;
+      outerStep = rows ? encoded.yStep : encoded.xStep;
+      dx = rows ? innerStep : 0;
+      dy = rows ? 0 : innerStep;
+    }
+
+    // Position of the first pixel of a line in the bitmap
+    void getStart(coord_t line, coord_t & x, coord_t & y) const
+    {
+      coord_t outer = outerStep > 0 ? line : count - 1 - line;
+      coord_t inner = innerStep > 0 ? 0 : length - 1;
+      x = rows ? inner : outer;
+      y = rows ? outer : inner;
+    }
+
+    coord_t length;
+    coord_t count;
+    coord_t dx; // the move from one pixel of a line to the next one
+    coord_t dy;
+
+  protected:
+    bool rows;
+    int innerStep;
+    int outerStep;
+};
+
+// The compressed data is decoded one line at a time. Only the visible part
+// of each line is drawn, with drawLiterals(p, pixels, count) for the pixels
+// which differ and drawRun(p, value, count) for the repeated ones
+template <class Decoder, class Literals, class Run>
+void BitmapBuffer::drawRLE(coord_t x, coord_t y, const uint8_t * rleData, Literals && drawLiterals, Run && drawRun)
+{
+  typedef typename Decoder::Pixel P;
+
+  coord_t w = *((uint16_t *)rleData);
+  coord_t h = *(((uint16_t *)rleData) + 1);
+
+  EncodedLines lines(w, h);
+  coord_t length = lines.length;
+  coord_t dx = lines.dx;
+  coord_t dy = lines.dy;
+  int step = dx * layout.xStep + dy * layout.yStep;
+
+  Decoder decoder(rleData + 4, lines.count);
+  P literals[BLIT_LINE_CHUNK];
+
+  for (coord_t line = 0; line < lines.count; line++) {
+    coord_t x0, y0;
+    lines.getStart(line, x0, y0);
+    x0 += x;
+    y0 += y;
+
+    coord_t first = 0;
+    coord_t last = length;
+    clipSteps(x0 - xmin, dx, xmax - xmin, first, last);
+    clipSteps(y0 - ymin, dy, ymax - ymin, first, last);
+    if (first >= last) {
+      decoder.endLine(length);
+      continue;
+    }
+
+    decoder.startLine(line);
+    decoder.skip(first);
+
+    // the pending pixels end at k, they are either literals or a run
+    coord_t k = first;
+    coord_t pending = 0;
+    bool run = false;
+    P runValue = 0;
+    auto flush = [&]() {
+      if (pending > 0) {
+        PixelIterator<pixel_t> p = {getPixelPtrAbs(x0 + (k - pending) * dx, y0 + (k - pending) * dy), step};
+        if (run)
+          drawRun(p, runValue, pending);
+        else
+          drawLiterals(p, literals, pending);
+        pending = 0;
+      }
+    };
+
+    while (k < last) {
+      coord_t n = min<coord_t>(decoder.getRunLength(), last - k);
+      if (n > 0) {
+        P value = decoder.getRunPixel();
+        decoder.skipRun(n);
+        if (!run || value != runValue) {
+          flush();
+          run = true;
+          runValue = value;
+        }
+        pending += n;
+        k += n;
+      }
+      else {
+        P value = decoder.getPixel();
+        if (run && value == runValue) {
+          pending++;
+        }
+        else {
+          if (run || pending == BLIT_LINE_CHUNK) {
+            flush();
+          }
+          run = false;
+          literals[pending++] = value;
+        }
+        k++;
+      }
+    }
+    flush();
+
+    decoder.endLine(length - last);
+  }
+}
+
+template <template <class> class Decoder>
+void BitmapBuffer::drawRLEBitmap(coord_t x, coord_t y, uint8_t bitmapFormat, const uint8_t * rleData)
+{
+  if (!data || !rleData)
+    return;
+
+  APPLY_OFFSET();
+
+  dispatchPixelFormat(format, [&](auto destFormat) {
+    dispatchPixelFormat(bitmapFormat, [&](auto srcFormat) {
+      using DEST = decltype(destFormat);
+      using SRC = decltype(srcFormat);
+      drawRLE<Decoder<pixel_t>>(x, y, rleData,
+        [&](PixelIterator<pixel_t> p, const pixel_t * pixels, coord_t count) {
+          drawPixelsLine<DEST, SRC>(p, pixels, count);
+        },
+        [&](PixelIterator<pixel_t> p, pixel_t value, coord_t count) {
+          drawPixelsRun<DEST, SRC>(p, value, count);
+        });
+    });
+  });
+}
+
+template <template <class> class Decoder>
+void BitmapBuffer::drawRLEMask(coord_t x, coord_t y, const uint8_t * rleData, Color565 color)
 {
-  if (format == BMP_RGB565) {
-    if (alpha == ALPHA_MAX) {
-      drawPixel(p, color);
-    }
-    else if (alpha != 0) {
-      uint8_t bgAlpha = ALPHA_MAX - alpha;
-      RGB_SPLIT(color, red, green, blue);
-      RGB_SPLIT(*p, bgRed, bgGreen, bgBlue);
-      uint16_t r = (bgRed * bgAlpha + red * alpha) / ALPHA_MAX;
-      uint16_t g = (bgGreen * bgAlpha + green * alpha) / ALPHA_MAX;
-      uint16_t b = (bgBlue * bgAlpha + blue * alpha) / ALPHA_MAX;
-      drawPixel(p, RGB_JOIN(r, g, b));
-    }
-  }
-  else if (format == BMP_ARGB4444) {
-    if (alpha == ALPHA_MAX) {
-      drawPixel(p, RGB565_TO_ARGB4444(color, 0xFF));
-    }
-    else if (alpha != 0) {
-      // https://en.wikipedia.org/wiki/Alpha_compositing
-      ARGB_SPLIT(*p, bgAlpha, bgRed, bgGreen, bgBlue);
-      if (bgAlpha == 0) {
-        drawPixel(p, RGB565_TO_ARGB4444(color, alpha << 4));
+  if (!data || !rleData)
+    return;
+
+  APPLY_OFFSET();
+
+  drawRLE<Decoder<uint8_t>>(x, y, rleData,
+    [&](PixelIterator<pixel_t> p, const uint8_t * values, coord_t count) {
+      if (p.step == 1) {
+        blitAlphaMaskSpan(p.pixel, format == BMP_ARGB4444, values, count, color);
       }
       else {
-        RGB_SPLIT(color, red, green, blue);
-        red >>= 1;
-        green >>= 2;
-        blue >>= 1;
-        uint16_t a = alpha + (bgAlpha * (ALPHA_MAX - alpha)) / ALPHA_MAX;
-        uint16_t r = min<uint8_t>(0x0F, (red * alpha + bgRed * bgAlpha) / a);
-        uint16_t g = min<uint8_t>(0x0F, (green * alpha + bgGreen * bgAlpha) / a);
-        uint16_t b = min<uint8_t>(0x0F, (blue * alpha + bgBlue * bgAlpha) / a);
-        drawPixel(p, ARGB_JOIN(a, r, g, b));
+        for (coord_t i = 0; i < count; i++) {
+          drawAlphaPixel(&p[i], values[i] >> 4, color);
+        }
+      }
+    },
+    [&](PixelIterator<pixel_t> p, uint8_t value, coord_t count) {
+      blendPixels(p, count, value >> 4, color);
+    });
+}
+
+void BitmapBuffer::drawRLEBitmap(coord_t x, coord_t y, uint8_t bitmapFormat, const uint8_t * rleData)
+{
+  nextGeneration();
+  drawRLEBitmap<RLEDecoder>(x, y, bitmapFormat, rleData);
+}
+
+void BitmapBuffer::drawRLEMask(coord_t x, coord_t y, const uint8_t * rleData, Color565 color)
+{
+  nextGeneration();
+  drawRLEMask<RLEDecoder>(x, y, rleData, color);
+}
+
+void BitmapBuffer::drawPixelRLEBitmap(coord_t x, coord_t y, uint8_t bitmapFormat, const uint8_t * rleData)
+{
+  nextGeneration();
+  drawRLEBitmap<PixelRLEDecoder>(x, y, bitmapFormat, rleData);
+}
+
+void BitmapBuffer::drawPixelRLEMask(coord_t x, coord_t y, const uint8_t * rleData, Color565 color)
+{
+  nextGeneration();
+  drawRLEMask<PixelRLEDecoder>(x, y, rleData, color);
+}
+
+void BitmapBuffer::drawIndexedBitmap(coord_t x, coord_t y, const IndexedBitmapData * bmp)
+{
+  nextGeneration();
+  if (!data || !bmp)
+    return;
+
+  APPLY_OFFSET();
+
+  EncodedLines lines(bmp->width(), bmp->height());
+  int step = lines.dx * layout.xStep + lines.dy * layout.yStep;
+  bool packed = (bmp->getFormat() == BMP_INDEXED4);
+  coord_t lineSize = packed ? (lines.length + 1) / 2 : lines.length;
+  auto indexes = bmp->getIndexes();
+
+  // the 4 bits kernel needs a full palette
+  const uint16_t * palette = bmp->getPalette();
+  uint16_t palette16[16] = {};
+  if (packed) {
+    memcpy(palette16, palette, min<int>(16, bmp->getPaletteSize()) * sizeof(uint16_t));
+    palette = palette16;
+  }
+
+  auto expand = [&](pixel_t * dest, coord_t line, coord_t first, coord_t count) {
+    auto src = indexes + line * lineSize;
+    if (packed)
+      blitPalette4Span(dest, src + first / 2, first & 1, palette, count);
+    else
+      blitPaletteSpan(dest, src + first, palette, count);
+  };
+
+  dispatchPixelFormat(format, [&](auto destFormat) {
+    dispatchPixelFormat(bmp->getPaletteFormat(), [&](auto srcFormat) {
+      using DEST = decltype(destFormat);
+      using SRC = decltype(srcFormat);
+      pixel_t line[BLIT_LINE_CHUNK];
+      for (coord_t i = 0; i < lines.count; i++) {
+        coord_t x0, y0;
+        lines.getStart(i, x0, y0);
+        x0 += x;
+        y0 += y;
+
+        coord_t first = 0;
+        coord_t last = lines.length;
+        clipSteps(x0 - xmin, lines.dx, xmax - xmin, first, last);
+        clipSteps(y0 - ymin, lines.dy, ymax - ymin, first, last);
+        if (first >= last) {
+          continue;
+        }
+
+        PixelIterator<pixel_t> p = {getPixelPtrAbs(x0 + first * lines.dx, y0 + first * lines.dy), step};
+        if constexpr (!DEST::hasAlpha && !SRC::hasAlpha) {
+          if (step == 1) {
+            // the palette values are written straight to the destination
+            expand(p.pixel, i, first, last - first);
+            continue;
+          }
+        }
+
+        for (coord_t j = first; j < last; j += BLIT_LINE_CHUNK) {
+          coord_t count = min<coord_t>(BLIT_LINE_CHUNK, last - j);
+          expand(line, i, j, count);
+          drawPixelsLine<DEST, SRC>(p + (j - first), line, count);
+        }
       }
+    });
+  });
+}
+
+void BitmapBuffer::blendPixels(PixelIterator<pixel_t> p, coord_t count, uint8_t alpha, Color565 color)
+{
+  if (p.step == 1)
+    blitBlendSpan(p.pixel, format == BMP_ARGB4444, count, alpha, color);
+  else if (p.step == -1)
+    blitBlendSpan(p.pixel - count + 1, format == BMP_ARGB4444, count, alpha, color);
+  else
+    blitBlendColumn(p.pixel, p.step, format == BMP_ARGB4444, count, alpha, color);
+}
+
+void BitmapBuffer::fillPixels(PixelIterator<pixel_t> p, coord_t count, pixel_t value)
+{
+  if (p.step == 1) {
+    blitFillSpan(p.pixel, count, value);
+  }
+  else if (p.step == -1) {
+    blitFillSpan(p.pixel - count + 1, count, value);
+  }
+  else {
+    for (coord_t i = 0; i < count; i++, ++p) {
+      *p = value;
     }
   }
 }
 
+void BitmapBuffer::drawAlphaPixel(pixel_t * p, uint8_t alpha, Color565 color)
+{
+  if (alpha == 0)
+    return;
+
+  if (format == BMP_ARGB4444)
+    drawPixel(p, PixelFormat<BMP_ARGB4444>::blend(*p, alpha, color));
+  else
+    drawPixel(p, PixelFormat<BMP_RGB565>::blend(*p, alpha, color));
+}
+
 void BitmapBuffer::drawHorizontalLine(coord_t x, coord_t y, coord_t w, LcdColor color, uint8_t pat)
 {
+  nextGeneration();
   APPLY_OFFSET();
 
   coord_t h = 1;
@@ -237,26 +736,23 @@ void BitmapBuffer::drawHorizontalLine(coord_t x, coord_t y, coord_t w, LcdColor
 
 void BitmapBuffer::drawHorizontalLineAbs(coord_t x, coord_t y, coord_t w, LcdColor color, uint8_t pat)
 {
-  pixel_t * p = getPixelPtrAbs(x, y);
+  auto p = getRow(x, y);
   auto rgb565 = COLOR_TO_RGB565(color);
   uint8_t alpha = GET_COLOR_ALPHA(color);
 
   if (pat == SOLID) {
-    while (w--) {
-      drawAlphaPixel(p, alpha, rgb565);
-      p = getNextPixel(p, 1);
-    }
+    blendPixels(p, w, alpha, rgb565);
   }
   else {
     while (w--) {
       if (pat & 1) {
-        drawAlphaPixel(p, alpha, rgb565);
+        drawAlphaPixel(p.pixel, alpha, rgb565);
         pat = (pat >> 1) | 0x80;
       }
       else {
         pat = pat >> 1;
       }
-      p = getNextPixel(p, 1);
+      ++p;
     }
   }
 }
@@ -269,6 +765,7 @@ T ror(T n, unsigned d)
 
 void BitmapBuffer::drawVerticalLine(coord_t x, coord_t y, coord_t h, LcdColor color, uint8_t pat)
 {
+  nextGeneration();
   APPLY_OFFSET();
 
   coord_t w = 1;
@@ -284,10 +781,7 @@ void BitmapBuffer::drawVerticalLine(coord_t x, coord_t y, coord_t h, LcdColor co
   uint8_t alpha = GET_COLOR_ALPHA(color);
 
   if (pat == SOLID) {
-    while (h--) {
-      drawAlphaPixelAbs(x, y, alpha, rgb565);
-      y++;
-    }
+    blendPixels(getColumn(x, y), h, alpha, rgb565);
   }
   else {
     if (pat == DOTTED && !(y & 1)) {
@@ -340,6 +834,7 @@ void BitmapBuffer::drawLine(coord_t x1, coord_t y1, coord_t x2, coord_t y2, LcdC
 // limitations under the License.
 // ----------------------------------------------------------------------------
 
+  nextGeneration();
 
   // Offsets
   x1 += offsetX;
@@ -830,6 +1325,7 @@ void BitmapBuffer::fillTopFlatTriangle(coord_t x0, coord_t y01, coord_t x1, coor
 
 void BitmapBuffer::drawFilledTriangle(coord_t x0, coord_t y0, coord_t x1, coord_t y1, coord_t x2, coord_t y2, LcdColor color)
 {
+  nextGeneration();
   // Sort the points so that y0 <= y1 <= y2
   if (y1 < y0) {
     std::swap(x1, x0);
@@ -862,6 +1358,7 @@ void BitmapBuffer::drawFilledTriangle(coord_t x0, coord_t y0, coord_t x1, coord_
 
 void BitmapBuffer::drawRectangle(coord_t x, coord_t y, coord_t w, coord_t h, LcdColor color, uint8_t thickness, uint8_t pat)
 {
+  nextGeneration();
   for (unsigned i = 0; i < thickness; i++) {
     drawVerticalLine(x + i, y, h, color, pat);
     drawVerticalLine(x + w - 1 - i, y, h, color, pat);
@@ -882,6 +1379,7 @@ void BitmapBuffer::fillRectangle(coord_t x, coord_t y, coord_t w, coord_t h, pix
 
 void BitmapBuffer::drawPlainFilledRectangle(coord_t x, coord_t y, coord_t w, coord_t h, Color565 color)
 {
+  nextGeneration();
   if (format == BMP_RGB565)
     fillRectangle(x, y, w, h, color);
   else
@@ -890,6 +1388,7 @@ void BitmapBuffer::drawPlainFilledRectangle(coord_t x, coord_t y, coord_t w, coo
 
 void BitmapBuffer::drawMaskFilledRectangle(coord_t x, coord_t y, coord_t w, coord_t h, const BitmapMask * mask, Color565 color)
 {
+  nextGeneration();
   coord_t maskHeight = mask->height();
   while (h > 0) {
     if (maskHeight > h)
@@ -911,6 +1410,7 @@ void BitmapBuffer::drawMaskFilledRectangle(coord_t x, coord_t y, coord_t w, coor
 
 void BitmapBuffer::drawFilledRectangle(coord_t x, coord_t y, coord_t w, coord_t h, LcdColor color, uint8_t pat)
 {
+  nextGeneration();
   APPLY_OFFSET();
 
   if (!applyClippingRect(x, y, w, h))
@@ -923,6 +1423,7 @@ void BitmapBuffer::drawFilledRectangle(coord_t x, coord_t y, coord_t w, coord_t
 
 void BitmapBuffer::drawCircle(coord_t x, coord_t y, coord_t radius, LcdColor color)
 {
+  nextGeneration();
   int x1 = radius;
   int y1 = 0;
   int decisionOver2 = 1 - x1;
@@ -951,6 +1452,7 @@ void BitmapBuffer::drawCircle(coord_t x, coord_t y, coord_t radius, LcdColor col
 
 void BitmapBuffer::drawPlainFilledCircle(coord_t x, coord_t y, coord_t radius, Color565 color)
 {
+  nextGeneration();
   coord_t imax = (radius * 707) / 1000 + 1;
   coord_t sqmax = radius * radius + radius / 2;
   coord_t x1 = radius;
@@ -972,6 +1474,7 @@ void BitmapBuffer::drawPlainFilledCircle(coord_t x, coord_t y, coord_t radius, C
 
 void BitmapBuffer::drawFilledCircle(coord_t x, coord_t y, coord_t radius, LcdColor color, uint8_t pat)
 {
+  nextGeneration();
   coord_t imax = ((coord_t)((coord_t)radius * 707)) / 1000 + 1;
   coord_t sqmax = (coord_t)radius * (coord_t)radius + (coord_t)radius / 2;
   coord_t x1 = radius;
@@ -991,180 +1494,381 @@ void BitmapBuffer::drawFilledCircle(coord_t x, coord_t y, coord_t radius, LcdCol
   }
 }
 
-class Slope
+// sin(angle) for angle = 0..90 degrees, 2.14 fixed point
+constexpr int16_t SINE_TABLE[91] = {
+  0, 286, 572, 857, 1143, 1428, 1713, 1997, 2280, 2563,
+  2845, 3126, 3406, 3686, 3964, 4240, 4516, 4790, 5063, 5334,
+  5604, 5872, 6138, 6402, 6664, 6924, 7182, 7438, 7692, 7943,
+  8192, 8438, 8682, 8923, 9162, 9397, 9630, 9860, 10087, 10311,
+  10531, 10749, 10963, 11174, 11381, 11585, 11786, 11982, 12176, 12365,
+  12551, 12733, 12911, 13085, 13255, 13421, 13583, 13741, 13894, 14044,
+  14189, 14330, 14466, 14598, 14726, 14849, 14968, 15082, 15191, 15296,
+  15396, 15491, 15582, 15668, 15749, 15826, 15897, 15964, 16026, 16083,
+  16135, 16182, 16225, 16262, 16294, 16322, 16344, 16362, 16374, 16382,
+  16384,
+};
+
+constexpr int fixedSin(int angle)
+{
+  angle = (angle % 360 + 360) % 360;
+  if (angle <= 90)
+    return SINE_TABLE[angle];
+  else if (angle <= 180)
+    return SINE_TABLE[180 - angle];
+  else if (angle <= 270)
+    return -SINE_TABLE[angle - 180];
+  else
+    return -SINE_TABLE[360 - angle];
+}
+
+constexpr int fixedCos(int angle)
+{
+  return fixedSin(angle + 90);
+}
+
+// The pixels of one row which are inside the sector going clockwise from
+// startAngle to endAngle (0 is up), relative to the center of the sector.
+// A sector up to 180° is the intersection of 2 half-planes, so it covers one
+// span of each row, a larger one is the complement of such a sector.
+class SectorSpans
 {
   public:
-    explicit Slope(int angle)
+    SectorSpans(int startAngle, int endAngle):
+      startX(fixedSin(startAngle)),
+      startY(-fixedCos(startAngle)),
+      endX(fixedSin(endAngle)),
+      endY(-fixedCos(endAngle))
     {
-      if (angle < 0)
-        angle += 360;
-      if (angle > 360)
-        angle %= 360;
-      auto radians = degrees2radians<float>(angle);
-      if (angle == 0) {
-        left = false;
-        value = 100000;
-      }
-      else if (angle == 360) {
-        left = true;
-        value = 100000;
-      }
-      else if (angle >= 180) {
-        left = true;
-        value = -(cosf(radians) * 100 / sinf(radians));
-      }
-      else {
-        left = false;
-        value = (cosf(radians) * 100 / sinf(radians));
-      }
+      auto sweep = mod(endAngle - startAngle, 360);
+      full = (sweep == 0 && endAngle > startAngle);
+      empty = (sweep == 0 && endAngle < startAngle);
+      convex = (sweep <= 180);
     }
 
-    Slope(bool left, int value):
-      left(left),
-      value(value)
+    // Returns the number of spans of the row dy, in [left, right]
+    uint8_t get(coord_t dy, coord_t left, coord_t right, coord_t * x0, coord_t * x1) const
     {
-    }
+      if (empty) {
+        return 0;
+      }
 
-    bool isBetween(const Slope & start, const Slope & end) const
-    {
-      if (left) {
-        if (start.left) {
-          if (end.left)
-            return end.value > start.value ? (value <= end.value && value >= start.value) : (value <= end.value || value >= start.value);
-          else
-            return value >= start.value;
-        }
-        else {
-          if (end.left)
-            return value <= end.value;
-          else
-            return end.value > start.value;
-        }
+      if (full) {
+        x0[0] = left;
+        x1[0] = right;
+        return 1;
       }
-      else {
-        if (start.left) {
-          if (end.left)
-            return start.value > end.value;
-          else
-            return value >= end.value;
-        }
-        else {
-          if (end.left)
-            return value <= start.value;
-          else
-            return end.value < start.value ? (value >= end.value && value <= start.value) : (value <= start.value || value >= end.value);
-        }
+
+      coord_t lo = left;
+      coord_t hi = right;
+
+      if (convex) {
+        // clockwise from the start ray and anticlockwise from the end ray
+        solve(startY, startX * dy, lo, hi);
+        solve(-endY, -endX * dy, lo, hi);
+        x0[0] = lo;
+        x1[0] = hi;
+        return lo <= hi ? 1 : 0;
       }
-    }
 
-    Slope & invertVertical()
-    {
-      value = -value;
-      return *this;
+      // the complement is strictly between the end and the start rays
+      solve(endY, endX * dy - 1, lo, hi);
+      solve(-startY, -startX * dy - 1, lo, hi);
+      if (lo > hi) {
+        x0[0] = left;
+        x1[0] = right;
+        return 1;
+      }
+      uint8_t count = 0;
+      if (lo > left) {
+        x0[count] = left;
+        x1[count++] = lo - 1;
+      }
+      if (hi < right) {
+        x0[count] = hi + 1;
+        x1[count++] = right;
+      }
+      return count;
     }
 
-    Slope & invertHorizontal()
+  protected:
+    int startX, startY;
+    int endX, endY;
+    bool full;
+    bool empty;
+    bool convex;
+
+    // Restricts [lo, hi] to the dx such that a * dx <= b
+    static void solve(int a, int b, coord_t & lo, coord_t & hi)
     {
-      left = !left;
-      return *this;
+      if (a > 0) {
+        hi = min<coord_t>(hi, floorDiv(b, a));
+      }
+      else if (a < 0) {
+        lo = max<coord_t>(lo, -floorDiv(b, -a));
+      }
+      else if (b < 0) {
+        lo = hi + 1;
+      }
     }
-
-  protected:
-    bool left;
-    int value;
 };
 
 void BitmapBuffer::drawBitmapPatternPie(coord_t x, coord_t y, const uint8_t * img, LcdColor color, int startAngle, int endAngle)
 {
+  nextGeneration();
   if (endAngle == startAngle) {
     endAngle += 1;
   }
 
-  Slope startSlope(startAngle);
-  Slope endSlope(endAngle);
+  SectorSpans sector(startAngle, endAngle);
 
   auto rgb565 = COLOR_TO_RGB565(color);
+  auto bitmap = (const BitmapData *)img;
+  coord_t w2 = bitmap->width() / 2;
+  coord_t h2 = bitmap->height() / 2;
 
-  auto bitmap = (BitmapData *)img;
-  coord_t width = bitmap->width();
-  coord_t height = bitmap->height();
-  const uint8_t * q = bitmap->data;
-
-  int w2 = width / 2;
-  int h2 = height / 2;
-
-  for (int y1 = h2 - 1; y1 >= 0; y1--) {
-    for (int x1 = w2 - 1; x1 >= 0; x1--) {
-      Slope slope(false, x1 == 0 ? 99000 : y1 * 100 / x1);
-      if (slope.isBetween(startSlope, endSlope)) {
-        drawAlphaPixel(x + w2 + x1, y + h2 - y1, q[(h2 - y1) * width + w2 + x1] >> 4, rgb565);
-      }
-      if (slope.invertVertical().isBetween(startSlope, endSlope)) {
-        drawAlphaPixel(x + w2 + x1, y + h2 + y1, q[(h2 + y1) * width + w2 + x1] >> 4, rgb565);
-      }
-      if (slope.invertHorizontal().isBetween(startSlope, endSlope)) {
-        drawAlphaPixel(x + w2 - x1, y + h2 + y1, q[(h2 + y1) * width + w2 - x1] >> 4, rgb565);
-      }
-      if (slope.invertVertical().isBetween(startSlope, endSlope)) {
-        drawAlphaPixel(x + w2 - x1, y + h2 - y1, q[(h2 - y1) * width + w2 - x1] >> 4, rgb565);
-      }
+  // only the runs of the mask inside the sector are drawn
+  for (coord_t dy = 1 - h2; dy < h2; dy++) {
+    coord_t x0[2], x1[2];
+    auto count = sector.get(dy, 1 - w2, w2 - 1, x0, x1);
+    for (uint8_t i = 0; i < count; i++) {
+      drawMask(x + w2 + x0[i], y + h2 + dy, bitmap, rgb565, w2 + x0[i], h2 + dy, x1[i] - x0[i] + 1, 1);
     }
   }
 }
 
-void BitmapBuffer::drawAnnulusSector(coord_t x, coord_t y, coord_t internalRadius, coord_t externalRadius, LcdColor color, int startAngle, int endAngle)
+void BitmapBuffer::drawBitmapPie(int x0, int y0, const uint16_t * img, int startAngle, int endAngle)
 {
+  nextGeneration();
   if (endAngle == startAngle) {
     endAngle += 1;
   }
 
-  Slope startSlope(startAngle);
-  Slope endSlope(endAngle);
+  SectorSpans sector(startAngle, endAngle);
 
-  auto rgb565 = COLOR_TO_RGB565(color);
-  APPLY_OFFSET();
+  Bitmap bitmap(BMP_RGB565, img);
+  coord_t w2 = bitmap.width() / 2;
+  coord_t h2 = bitmap.height() / 2;
 
-  coord_t internalDist = internalRadius * internalRadius;
-  coord_t externalDist = externalRadius * externalRadius;
-
-  for (int y1 = 0; y1 <= externalRadius; y1++) {
-    for (int x1 = 0; x1 <= externalRadius; x1++) {
-      auto dist = x1 * x1 + y1 * y1;
-      if (dist >= internalDist && dist <= externalDist) {
-        Slope slope(false, x1 == 0 ? 99000 : y1 * 100 / x1);
-        if (slope.isBetween(startSlope, endSlope))
-          drawPixelAbsWithClipping(x + x1, y - y1, rgb565);
-        if (slope.invertVertical().isBetween(startSlope, endSlope))
-          drawPixelAbsWithClipping(x + x1, y + y1, rgb565);
-        if (slope.invertHorizontal().isBetween(startSlope, endSlope))
-          drawPixelAbsWithClipping(x - x1, y + y1, rgb565);
-        if (slope.invertVertical().isBetween(startSlope, endSlope))
-          drawPixelAbsWithClipping(x - x1, y - y1, rgb565);
-      }
+  for (coord_t dy = 1 - h2; dy < h2; dy++) {
+    coord_t left[2], right[2];
+    auto count = sector.get(dy, 1 - w2, w2 - 1, left, right);
+    for (uint8_t i = 0; i < count; i++) {
+      drawBitmap(x0 + w2 + left[i], y0 + h2 + dy, &bitmap, w2 + left[i], h2 + dy, right[i] - left[i] + 1, 1);
     }
   }
 }
 
-template <class T>
-void BitmapBuffer::drawMask(coord_t x, coord_t y, const T * mask, Color565 color, coord_t srcx, coord_t srcy, coord_t srcw, coord_t srch)
+void BitmapBuffer::drawAnnulusSector(coord_t x, coord_t y, coord_t internalRadius, coord_t externalRadius, LcdColor color, int startAngle, int endAngle, bool antiAliasing)
 {
-  if (!mask)
+  nextGeneration();
+  if (!data)
     return;
 
+  if (endAngle == startAngle) {
+    endAngle += 1;
+  }
+
+  SectorSpans sector(startAngle, endAngle);
+
+  auto rgb565 = COLOR_TO_RGB565(color);
+  pixel_t pixel = (format == BMP_ARGB4444 ? RGB565_TO_ARGB4444(rgb565, 0xFF) : rgb565);
   APPLY_OFFSET();
 
-  coord_t maskWidth = mask->width();
-  coord_t maskHeight = mask->height();
+  // the rows and columns outside of the clipping rect are rejected up front
+  coord_t top = max<coord_t>(-externalRadius, ymin - y);
+  coord_t bottom = min<coord_t>(externalRadius, ymax - 1 - y);
+  coord_t left = xmin - x;
+  coord_t right = xmax - 1 - x;
+  if (left > right)
+    return;
 
-  if (!srcw) {
-    srcw = maskWidth;
-  }
+  int internalDist = internalRadius * internalRadius;
+  int externalDist = externalRadius * externalRadius;
+
+  // calls function for the parts of [x0, x1] inside the sector and the clipping rect
+  auto forEachSpan = [&](coord_t dy, coord_t x0, coord_t x1, auto && function) {
+    coord_t spanLeft[2], spanRight[2];
+    auto count = sector.get(dy, max(x0, left), min(x1, right), spanLeft, spanRight);
+    for (uint8_t i = 0; i < count; i++) {
+      function(spanLeft[i], spanRight[i]);
+    }
+  };
+
+  // anti-aliased pixels, their opacity is the distance to the edge
+  auto drawEdge = [&](coord_t dy, coord_t x0, coord_t x1, float edge) {
+    forEachSpan(dy, x0, x1, [&](coord_t spanLeft, coord_t spanRight) {
+      auto p = getRow(x + spanLeft, y + dy);
+      for (coord_t dx = spanLeft; dx <= spanRight; dx++, ++p) {
+        auto distance = sqrtf(dx * dx + dy * dy);
+        auto alpha = uint8_t(limit<float>(0, (1 - fabsf(distance - edge)) * ALPHA_MAX, ALPHA_MAX));
+        if (alpha) {
+          drawAlphaPixel(p.pixel, alpha, rgb565);
+        }
+      }
+    });
+  };
 
-  if (!srch) {
-    srch = maskHeight;
-  }
+  for (coord_t dy = top; dy <= bottom; dy++) {
+    // the ring covers the pixels with internalDist <= dist <= externalDist
+    coord_t outer = isqrt(externalDist - dy * dy);
+    coord_t inner = -1;
+    if (internalDist > dy * dy) {
+      inner = isqrt(internalDist - dy * dy - 1) + 1;
+    }
 
-  if (srcx + srcw > maskWidth) {
+    auto fill = [&](coord_t spanLeft, coord_t spanRight) {
+      fillPixels(getRow(x + spanLeft, y + dy), spanRight - spanLeft + 1, pixel);
+    };
+
+    if (inner <= 0) {
+      forEachSpan(dy, -outer, outer, fill);
+    }
+    else if (inner <= outer) {
+      forEachSpan(dy, -outer, -inner, fill);
+      forEachSpan(dy, inner, outer, fill);
+    }
+
+    if (antiAliasing) {
+      // the pixels with externalRadius < distance < externalRadius + 1
+      coord_t outerEdge = isqrt((externalRadius + 1) * (externalRadius + 1) - 1 - dy * dy);
+      if (outerEdge > outer) {
+        drawEdge(dy, -outerEdge, -outer - 1, externalRadius);
+        drawEdge(dy, outer + 1, outerEdge, externalRadius);
+      }
+      // the pixels with internalRadius - 1 < distance < internalRadius
+      if (inner > 0) {
+        int dist = (internalRadius - 1) * (internalRadius - 1) - dy * dy;
+        coord_t innerEdge = (dist < 0 ? 0 : isqrt(dist) + 1);
+        drawEdge(dy, -inner + 1, -max<coord_t>(innerEdge, 1), internalRadius);
+        drawEdge(dy, innerEdge, inner - 1, internalRadius);
+      }
+    }
+  }
+}
+
+// The encoded masks (fonts, icons) use the LCD layout
+static PixelLayout getMaskLayout(const BitmapData * mask)
+{
+  return PixelLayout::lcd(mask->width(), mask->height());
+}
+
+template <class T>
+static PixelLayout getMaskLayout(const T * mask)
+{
+  return mask->getPixelLayout();
+}
+
+template <class T>
+void BitmapBuffer::drawMask(coord_t x, coord_t y, const T * mask, Color565 color, coord_t srcx, coord_t srcy, coord_t srcw, coord_t srch, BitmapTransform transform)
+{
+  nextGeneration();
+  if (!mask)
+    return;
+
+  APPLY_OFFSET();
+
+  coord_t maskWidth = mask->width();
+  coord_t maskHeight = mask->height();
+
+  if (!srcw) {
+    srcw = maskWidth;
+  }
+
+  if (!srch) {
+    srch = maskHeight;
+  }
+
+  if (srcx + srcw > maskWidth) {
+    srcw = maskWidth - srcx;
+  }
+
+  if (srcy + srch > maskHeight) {
+    srch = maskHeight - srcy;
+  }
+
+  // from here the source rect is given in the view coordinates
+  PixelView<uint8_t> view(mask->getData(), getMaskLayout(mask), maskWidth, maskHeight, transform);
+  transformRect(transform, maskWidth, maskHeight, srcx, srcy, srcw, srch);
+
+  if (x < xmin) {
+    srcw += x - xmin;
+    srcx -= x - xmin;
+    x = xmin;
+  }
+  if (y < ymin) {
+    srch += y - ymin;
+    srcy -= y - ymin;
+    y = ymin;
+  }
+  if (x + srcw > xmax) {
+    srcw = xmax - x;
+  }
+  if (y + srch > ymax) {
+    srch = ymax - y;
+  }
+
+  if (srcw <= 0 || srch <= 0) {
+    return;
+  }
+
+  auto rgb565 = COLOR_TO_RGB565(color);
+
+  if (transform == BMP_TRANSFORM_NONE) {
+    DMACopyAlphaMask(data, format == BMP_ARGB4444, _width, _height, x, y, mask->getData(), maskWidth, maskHeight, srcx, srcy, srcw, srch, rgb565);
+    return;
+  }
+
+  // the mask is transformed while it is drawn
+  uint8_t line[BLIT_LINE_CHUNK];
+  for (coord_t i = 0; i < srch; i++) {
+    auto p = getRow(x, y + i);
+    auto q = view.getRow(srcx, srcy + i);
+    for (coord_t j = 0; j < srcw; j += BLIT_LINE_CHUNK) {
+      coord_t count = min<coord_t>(BLIT_LINE_CHUNK, srcw - j);
+      for (coord_t k = 0; k < count; k++) {
+        line[k] = q[j + k];
+      }
+      if (p.step == 1) {
+        blitAlphaMaskSpan(p.pixel + j, format == BMP_ARGB4444, line, count, rgb565);
+      }
+      else {
+        for (coord_t k = 0; k < count; k++) {
+          drawAlphaPixel(&p[j + k], line[k] >> 4, rgb565);
+        }
+      }
+    }
+  }
+}
+
+template void BitmapBuffer::drawMask(coord_t, coord_t, const BitmapData *, Color565, coord_t, coord_t, coord_t, coord_t, BitmapTransform);
+template void BitmapBuffer::drawMask(coord_t, coord_t, const BitmapMask *, Color565, coord_t, coord_t, coord_t, coord_t, BitmapTransform);
+template void BitmapBuffer::drawMask(coord_t, coord_t, const StaticMask *, Color565, coord_t, coord_t, coord_t, coord_t, BitmapTransform);
+
+#if !defined(DMA_COPY_ALPHA_MASK4)
+// Size of the tiles the packed masks are unpacked to
+constexpr coord_t PACKED_MASK_TILE = 32;
+#endif
+
+void BitmapBuffer::drawMask(coord_t x, coord_t y, const PackedBitmapData * mask, Color565 color, coord_t srcx, coord_t srcy, coord_t srcw, coord_t srch)
+{
+  nextGeneration();
+  if (!mask)
+    return;
+
+  APPLY_OFFSET();
+
+  coord_t maskWidth = mask->width();
+  coord_t maskHeight = mask->height();
+
+  if (!srcw) {
+    srcw = maskWidth;
+  }
+
+  if (!srch) {
+    srch = maskHeight;
+  }
+
+  if (srcx + srcw > maskWidth) {
     srcw = maskWidth - srcx;
   }
 
@@ -1194,15 +1898,64 @@ void BitmapBuffer::drawMask(coord_t x, coord_t y, const T * mask, Color565 color
   }
 
   auto rgb565 = COLOR_TO_RGB565(color);
-  DMACopyAlphaMask(data, format == BMP_ARGB4444, _width, _height, x, y, mask->getData(), maskWidth, maskHeight, srcx, srcy, srcw, srch, rgb565);
+
+#if defined(DMA_COPY_ALPHA_MASK4)
+  DMACopyAlphaMask4(data, format == BMP_ARGB4444, _width, _height, x, y, mask->getData(), maskWidth, maskHeight, srcx, srcy, srcw, srch, rgb565);
+#else
+  // without the hook the mask is unpacked by tiles drawn with DMACopyAlphaMask()
+  auto maskLayout = PixelLayout::lcd(maskWidth, maskHeight);
+  EncodedLines lines(maskWidth, maskHeight);
+  int lineSize = (lines.length + 1) / 2;
+  uint8_t tile[PACKED_MASK_TILE * PACKED_MASK_TILE];
+  for (coord_t ty = 0; ty < srch; ty += PACKED_MASK_TILE) {
+    coord_t th = min<coord_t>(PACKED_MASK_TILE, srch - ty);
+    for (coord_t tx = 0; tx < srcw; tx += PACKED_MASK_TILE) {
+      coord_t tw = min<coord_t>(PACKED_MASK_TILE, srcw - tx);
+      auto tileLayout = PixelLayout::lcd(tw, th);
+      for (coord_t i = 0; i < th; i++) {
+        for (coord_t j = 0; j < tw; j++) {
+          int index = maskLayout.getOffset(srcx + tx + j, srcy + ty + i);
+          int k = index % lines.length;
+          uint8_t value = mask->getData()[(index / lines.length) * lineSize + k / 2];
+          tile[tileLayout.getOffset(j, i)] = (k & 1 ? value >> 4 : value & 0x0F) * 0x11;
+        }
+      }
+      DMACopyAlphaMask(data, format == BMP_ARGB4444, _width, _height, x + tx, y + ty, tile, tw, th, 0, 0, tw, th, rgb565);
+    }
+  }
+#endif
 }
 
-template void BitmapBuffer::drawMask(coord_t, coord_t, const BitmapData *, Color565, coord_t, coord_t, coord_t, coord_t);
-template void BitmapBuffer::drawMask(coord_t, coord_t, const BitmapMask *, Color565, coord_t, coord_t, coord_t, coord_t);
-template void BitmapBuffer::drawMask(coord_t, coord_t, const StaticMask *, Color565, coord_t, coord_t, coord_t, coord_t);
+PackedMask * PackedMask::pack(const BitmapMask * mask)
+{
+  if (!mask)
+    return nullptr;
+
+  EncodedLines lines(mask->width(), mask->height());
+  coord_t lineSize = (lines.length + 1) / 2;
+  auto data = (PackedBitmapData *)malloc(sizeof(PackedBitmapData) + lines.count * lineSize);
+  if (!data)
+    return nullptr;
+
+  data->_width = mask->width();
+  data->_height = mask->height();
+  memset(data->data, 0, lines.count * lineSize);
+  for (coord_t i = 0; i < lines.count; i++) {
+    coord_t x, y;
+    lines.getStart(i, x, y);
+    uint8_t * line = data->data + i * lineSize;
+    for (coord_t k = 0; k < lines.length; k++) {
+      uint8_t value = *mask->getPixelPtrAbs(x + k * lines.dx, y + k * lines.dy) >> 4;
+      line[k / 2] |= (k & 1) ? value << 4 : value;
+    }
+  }
+
+  return new PackedMask(data);
+}
 
 void BitmapBuffer::drawMask(coord_t x, coord_t y, const BitmapMask * mask, const BitmapBuffer * srcBitmap, coord_t offsetX, coord_t offsetY, coord_t width, coord_t height)
 {
+  nextGeneration();
   if (!mask || !srcBitmap)
     return;
 
@@ -1232,31 +1985,168 @@ void BitmapBuffer::drawMask(coord_t x, coord_t y, const BitmapMask * mask, const
   if (y >= ymax || x >= xmax || width <= 0 || x + width < xmin || y + height < ymin)
     return;
 
-  for (coord_t yCur = 0; yCur < height; yCur++) {
-    if (y + yCur < ymin || y + yCur >= ymax)
-      continue;
-    auto * p = getPixelPtrAbs(x, y + yCur);
-    const auto * q = mask->getPixelPtrAbs(offsetX, offsetY + yCur);
-    for (coord_t xCur = 0; xCur < width; xCur++) {
-      drawAlphaPixel(p, (*q) >> 4, *srcBitmap->getPixelPtrAbs(xCur, yCur));
-      p = getNextPixel(p);
-      q = mask->getNextPixel(q);
+  dispatchPixelFormat(format, [&](auto destFormat) {
+    using DEST = decltype(destFormat);
+    for (coord_t yCur = 0; yCur < height; yCur++) {
+      if (y + yCur < ymin || y + yCur >= ymax)
+        continue;
+      auto * p = getPixelPtrAbs(x, y + yCur);
+      const auto * q = mask->getPixelPtrAbs(offsetX, offsetY + yCur);
+      for (coord_t xCur = 0; xCur < width; xCur++) {
+        drawPixel(p, DEST::blend(*p, (*q) >> 4, *srcBitmap->getPixelPtrAbs(xCur, yCur)));
+        p = getNextPixel(p);
+        q = mask->getNextPixel(q);
+      }
     }
-  }
+  });
 }
 
 uint8_t BitmapBuffer::drawChar(coord_t x, coord_t y, const Font::Glyph & glyph, LcdColor color)
 {
   if (glyph.width) {
-    drawMask(x, y, glyph.font->getBitmapData(), color, glyph.offset, 0, glyph.width);
+    if (glyph.font->getAtlas()) {
+      GlyphAtlas::Cell cell;
+      auto atlas = glyph.font->getAtlas()->getGlyph(glyph.index, cell);
+      if (atlas)
+        drawMask(x + cell.left, y + cell.top, atlas, color, cell.x, cell.y, cell.width, cell.height);
+    }
+    else if (glyph.font->getPages()) {
+      coord_t offset;
+      auto page = glyph.font->getPages()->getPage(glyph.index, offset);
+      if (page)
+        drawMask(x, y, page, color, offset, 0, glyph.width);
+    }
+    else if (glyph.font->isPacked())
+      drawMask(x, y, glyph.font->getPackedBitmapData(), color, glyph.offset, 0, glyph.width);
+    else
+      drawMask(x, y, glyph.font->getBitmapData(), color, glyph.offset, 0, glyph.width);
   }
   return glyph.width;
 }
 
+uint8_t BitmapBuffer::drawGlyph(GlyphRun & run, coord_t x, coord_t y, const Font::Glyph & glyph, Color565 color)
+{
+  auto font = glyph.font;
+  coord_t w = glyph.width;
+  coord_t h = font->getHeight();
+
+  // the TrueType glyphs are drawn in their own box, which may overhang the
+  // advance
+  GlyphAtlas::Cell cell;
+  if (font->getAtlas()) {
+    cell = font->getAtlas()->getBounds(glyph.index);
+    x += cell.left;
+    y += cell.top;
+    w = cell.width;
+    h = cell.height;
+  }
+
+  // the glyphs out of the clipping rect are neither loaded nor rasterized
+  if (!w || x + w <= xmin || x >= xmax || y + h <= ymin || y >= ymax) {
+    return glyph.width;
+  }
+
+  if (font->isPacked()) {
+    flushGlyphRun(run);
+    return drawChar(x, y, glyph, color);
+  }
+
+  const uint8_t * mask;
+  coord_t maskWidth, maskHeight;
+  coord_t srcx = glyph.offset, srcy = 0;
+
+  if (font->getAtlas()) {
+    auto atlas = font->getAtlas();
+    if (!atlas->isRendered(glyph.index)) {
+      flushGlyphRun(run);
+    }
+    auto bitmap = atlas->getGlyph(glyph.index, cell);
+    if (!bitmap) {
+      return glyph.width;
+    }
+    srcx = cell.x;
+    srcy = cell.y;
+    mask = bitmap->getData();
+    maskWidth = bitmap->width();
+    maskHeight = bitmap->height();
+  }
+  else {
+    const BitmapData * bitmap;
+    if (font->getPages()) {
+      auto pages = font->getPages();
+      if (!pages->isLoaded(glyph.index)) {
+        flushGlyphRun(run);
+      }
+      bitmap = pages->getPage(glyph.index, srcx);
+    }
+    else {
+      bitmap = font->getBitmapData();
+    }
+    if (!bitmap) {
+      return glyph.width;
+    }
+    mask = bitmap->getData();
+    maskWidth = bitmap->width();
+    maskHeight = bitmap->height();
+  }
+
+  if (srcy + h > maskHeight) {
+    h = maskHeight - srcy;
+  }
+
+  if (x < xmin) {
+    w += x - xmin;
+    srcx -= x - xmin;
+    x = xmin;
+  }
+  if (y < ymin) {
+    h += y - ymin;
+    srcy -= y - ymin;
+    y = ymin;
+  }
+  if (x + w > xmax) {
+    w = xmax - x;
+  }
+  if (y + h > ymax) {
+    h = ymax - y;
+  }
+
+  if (w <= 0 || h <= 0) {
+    return glyph.width;
+  }
+
+  if (run.count == GLYPH_RUN_SIZE || run.mask != mask || run.color != color) {
+    flushGlyphRun(run);
+    run.mask = mask;
+    run.maskWidth = maskWidth;
+    run.maskHeight = maskHeight;
+    run.color = color;
+  }
+
+  run.rects[run.count++] = {int16_t(x), int16_t(y), int16_t(srcx), int16_t(srcy), int16_t(w), int16_t(h)};
+  return glyph.width;
+}
+
+void BitmapBuffer::flushGlyphRun(GlyphRun & run)
+{
+  if (run.count) {
+#if defined(DMA_COPY_ALPHA_MASKS)
+    DMACopyAlphaMasks(data, format == BMP_ARGB4444, _width, _height, run.mask, run.maskWidth, run.maskHeight, run.rects, run.count, run.color);
+#else
+    for (uint8_t i = 0; i < run.count; i++) {
+      auto & rect = run.rects[i];
+      DMACopyAlphaMask(data, format == BMP_ARGB4444, _width, _height, rect.x, rect.y, run.mask, run.maskWidth, run.maskHeight, rect.srcx, rect.srcy, rect.w, rect.h, run.color);
+    }
+#endif
+    run.count = 0;
+  }
+}
+
 #define INCREMENT_POS(delta)    do { if (flags & VERTICAL) y -= delta; else x += delta; } while(0)
 
 coord_t BitmapBuffer::drawSizedText(coord_t x, coord_t y, const char * s, uint8_t len, LcdColor color, LcdFlags flags)
 {
+  nextGeneration();
   MOVE_OFFSET();
 
   auto font = getFont(flags);
@@ -1280,6 +2170,10 @@ coord_t BitmapBuffer::drawSizedText(coord_t x, coord_t y, const char * s, uint8_
   coord_t & pos = (flags & VERTICAL) ? y : x;
   const coord_t orig_pos = pos;
 
+  // the glyphs are laid out first, then drawn by runs
+  GlyphRun run;
+  auto rgb565 = COLOR_TO_RGB565(color);
+
   for (int i = 0; len == 0 || i < len; ++i) {
     unsigned int c = uint8_t(*s);
     // TRACE("c = %d %o 0x%X '%c'", c, c, c, c);
@@ -1291,12 +2185,12 @@ coord_t BitmapBuffer::drawSizedText(coord_t x, coord_t y, const char * s, uint8_
       // CJK char
       auto glyph = font->getCJKChar(c, *++s);
       // TRACE("CJK = %d", c);
-      uint8_t width = drawChar(x, y, glyph, color);
+      uint8_t width = drawGlyph(run, x, y, glyph, rgb565);
       INCREMENT_POS(width + CHAR_SPACING);
     }
     else if (c >= 0x20) {
       auto glyph = font->getChar(c);
-      uint8_t width = drawChar(x, y, glyph, color);
+      uint8_t width = drawGlyph(run, x, y, glyph, rgb565);
       if (c >= '0' && c <= '9')
         INCREMENT_POS(font->getChar('9').width + CHAR_SPACING);
       else
@@ -1313,88 +2207,216 @@ coord_t BitmapBuffer::drawSizedText(coord_t x, coord_t y, const char * s, uint8_
     s++;
   }
 
+  flushGlyphRun(run);
+
   RESTORE_OFFSET();
 
   return ((flags & RIGHT) ? orig_pos : pos) - offsetX;
 }
 
+coord_t BitmapBuffer::drawTextLayout(coord_t x, coord_t y, const TextLayout & layout, LcdColor color, coord_t interline)
+{
+  nextGeneration();
+  MOVE_OFFSET();
+
+  auto font = layout.getFont();
+  if (!font) {
+    RESTORE_OFFSET();
+    return x - offsetX;
+  }
+
+  auto flags = layout.getFlags();
+  int height = font->getHeight();
+  int lineHeight = height + interline;
+  bool vertical = flags & VERTICAL;
+  unsigned count = layout.getLinesCount();
+
+  // start of a line along the text direction
+  auto getStart = [&](const TextLayout::Line & line) -> coord_t {
+    coord_t start = vertical ? y : x;
+    if (flags & RIGHT)
+      start += vertical ? line.width : -line.width;
+    else if (flags & CENTERED)
+      start += vertical ? line.width / 2 : -line.width / 2;
+    return start;
+  };
+
+  coord_t end = vertical ? y : x;
+  if (count > 0) {
+    auto & last = layout.getLine(count - 1);
+    end = (flags & RIGHT) ? getStart(last) : (vertical ? getStart(last) - last.width : getStart(last) + last.width);
+  }
+
+  // only the lines in the clipping rect are drawn
+  coord_t lineMin = vertical ? xmin : ymin;
+  coord_t lineMax = vertical ? xmax : ymax;
+  coord_t & linePos = vertical ? x : y;
+  unsigned first = 0;
+  if (lineHeight > 0 && linePos + height <= lineMin) {
+    first = floorDiv(lineMin - linePos - height, lineHeight) + 1;
+  }
+  linePos += first * lineHeight;
+
+  GlyphRun run;
+  auto rgb565 = COLOR_TO_RGB565(color);
+
+  for (unsigned i = first; i < count && linePos < lineMax; i++, linePos += lineHeight) {
+    auto & line = layout.getLine(i);
+    coord_t start = getStart(line);
+    for (unsigned j = line.first; j < line.first + line.count; j++) {
+      auto & item = layout.getItem(j);
+      if (vertical)
+        drawGlyph(run, x, start - item.pos, item.glyph, rgb565);
+      else
+        drawGlyph(run, start + item.pos, y, item.glyph, rgb565);
+    }
+  }
+
+  flushGlyphRun(run);
+
+  RESTORE_OFFSET();
+
+  return end - offsetX;
+}
+
 char * numberToString(int32_t val, uint8_t len, const char * prefix, const char * suffix, LcdFlags flags)
 {
-  static char str[48+1]; // max=16 for the prefix, 16 chars for the number, 16 chars for the suffix
-  char * s = str + 32;
-  *s = '\0';
-  int idx = 0;
+  static char str[NUMBER_BUFFER_SIZE];
+  formatNumber(str, sizeof(str), val, flags, prefix, suffix);
+  return str;
+}
+
+static const char DIGITS_PAIRS[] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+// Writes the digits of value before end, two at a time, with at least
+// minDigits digits. Returns the first one
+static char * formatDigits(char * end, uint32_t value, int minDigits)
+{
+  char * s = end;
+  while (value >= 100) {
+    auto pair = &DIGITS_PAIRS[(value % 100) * 2];
+    value /= 100;
+    *--s = pair[1];
+    *--s = pair[0];
+  }
+  if (value >= 10) {
+    *--s = DIGITS_PAIRS[value * 2 + 1];
+    *--s = DIGITS_PAIRS[value * 2];
+  }
+  else {
+    *--s = '0' + value;
+  }
+  while (end - s < minDigits) {
+    *--s = '0';
+  }
+  return s;
+}
+
+static int countDigits(uint32_t value, int minDigits)
+{
+  int result = 1;
+  while (value >= 10) {
+    value /= 10;
+    result++;
+  }
+  return max(result, minDigits);
+}
+
+int formatNumber(char * buffer, int size, int32_t val, LcdFlags flags, const char * prefix, const char * suffix)
+{
+  if (size <= 0) {
+    return 0;
+  }
+
   int prec = FLAGS_TO_DECIMALS(flags);
-  bool neg = false;
-  if (val < 0) {
-    val = -val;
-    neg = true;
-  }
-  do {
-    *--s = '0' + (val % 10);
-    ++idx;
-    val /= 10;
-    if (prec != 0 && idx == prec) {
-      prec = 0;
-      *--s = '.';
-      if (val == 0)
-        *--s = '0';
-    }
-  } while (val != 0 || prec > 0);
-  if (neg) *--s = '-';
-
-  // TODO needs check on all string lengths ...
+  uint32_t value = val < 0 ? -uint32_t(val) : val;
+  char digits[16];
+  char * end = digits + sizeof(digits);
+  char * start = formatDigits(end, value, prec + 1);
+
+  int length = 0;
+  auto append = [&](char c) {
+    if (length < size - 1) {
+      buffer[length++] = c;
+    }
+  };
+
   if (prefix) {
-    int len = strlen(prefix);
-    if (len <= 16) {
-      s -= len;
-      memcpy(s, prefix, len);
+    for (auto s = prefix; *s; s++) {
+      append(*s);
     }
   }
+  if (val < 0) {
+    append('-');
+  }
+  for (auto s = start; s < end; s++) {
+    if (prec && s == end - prec) {
+      append('.');
+    }
+    append(*s);
+  }
   if (suffix) {
-    strncpy(&str[32], suffix, 16);
+    for (auto s = suffix; *s; s++) {
+      append(*s);
+    }
   }
-  return s;
+
+  buffer[length] = '\0';
+  return length;
 }
 
-coord_t BitmapBuffer::drawNumber(coord_t x, coord_t y, int32_t val, LcdColor color, LcdFlags flags, uint8_t len, const char * prefix, const char * suffix)
+coord_t getNumberWidth(int32_t val, LcdFlags flags, const char * prefix, const char * suffix)
 {
-  auto s = numberToString(val, len, prefix, suffix, flags);
-  return drawText(x, y, s, color, flags);
+  auto font = getFont(flags);
+  int prec = FLAGS_TO_DECIMALS(flags);
+  uint32_t value = val < 0 ? -uint32_t(val) : val;
+
+  coord_t result = countDigits(value, prec + 1) * (font->getChar('9').width + CHAR_SPACING);
+  if (val < 0) {
+    result += font->getChar('-').width + CHAR_SPACING;
+  }
+  if (prec) {
+    result += font->getChar('.').width + CHAR_SPACING;
+  }
+  if (prefix) {
+    result += font->getTextWidth(prefix);
+  }
+  if (suffix) {
+    result += font->getTextWidth(suffix);
+  }
+  return result;
 }
 
-//void BitmapBuffer::drawBitmapPie(int x0, int y0, const uint16_t * img, int startAngle, int endAngle)
-//{
-//  const uint16_t * q = img;
-//  coord_t width = *q++;
-//  coord_t height = *q++;
-//
-//  int slopes[4];
-//  if (!evalSlopes(slopes, startAngle, endAngle))
-//    return;
-//
-//  int w2 = width/2;
-//  int h2 = height/2;
-//
-//  for (int y=h2-1; y>=0; y--) {
-//    for (int x=w2-1; x>=0; x--) {
-//      int slope = (x==0 ? 99000 : y*100/x);
-//      if (slope >= slopes[0] && slope < slopes[1]) {
-//        *getPixelPtr(x0+w2+x, y0+h2-y) = q[(h2-y)*width + w2+x];
-//      }
-//      if (-slope >= slopes[0] && -slope < slopes[1]) {
-//        *getPixelPtr(x0+w2+x, y0+h2+y) = q[(h2+y)*width + w2+x];
-//      }
-//      if (slope >= slopes[2] && slope < slopes[3]) {
-//        *getPixelPtr(x0+w2-x, y0+h2-y) = q[(h2-y)*width + w2-x];
-//      }
-//      if (-slope >= slopes[2] && -slope < slopes[3]) {
-//        *getPixelPtr(x0+w2-x, y0+h2+y)  = q[(h2+y)*width + w2-x];
-//      }
-//    }
-//  }
-//}
-//
+coord_t BitmapBuffer::drawNumber(coord_t x, coord_t y, int32_t val, LcdColor color, LcdFlags flags, uint8_t len, const char * prefix, const char * suffix)
+{
+  nextGeneration();
+  char s[NUMBER_BUFFER_SIZE];
+  formatNumber(s, sizeof(s), val, flags, prefix, suffix);
+
+  if (!(flags & (RIGHT | CENTERED)) || (flags & VERTICAL)) {
+    return drawText(x, y, s, color, flags);
+  }
+
+  // the number is aligned here, without measuring its text again
+  coord_t width = getNumberWidth(val, flags, prefix, suffix);
+  if (flags & RIGHT) {
+    drawText(x - width, y, s, color, flags & ~(RIGHT | CENTERED));
+    return x - width;
+  }
+  else {
+    return drawText(x - width / 2, y, s, color, flags & ~(RIGHT | CENTERED));
+  }
+}
 
 BitmapBuffer * BitmapBuffer::load(const char * filename, int maxSize)
 {
@@ -1405,8 +2427,163 @@ BitmapBuffer * BitmapBuffer::load(const char * filename, int maxSize)
     return load_stb(filename, maxSize);
 }
 
+BitmapBuffer * BitmapBuffer::load(const char * filename, coord_t maxWidth, coord_t maxHeight)
+{
+  auto ext = getFileExtension(filename);
+  if (ext && !strcmp(ext, ".bmp"))
+    return load_bmp(filename, -1, maxWidth, maxHeight);
+  else
+    return load_stb(filename, -1, maxWidth, maxHeight);
+}
+
+// Size of an image reduced to fit in maxWidth x maxHeight (no limit when 0),
+// returns false when the image already fits
+static bool getLoadSize(coord_t srcWidth, coord_t srcHeight, coord_t maxWidth, coord_t maxHeight, coord_t & width, coord_t & height)
+{
+  width = srcWidth;
+  height = srcHeight;
+  if (maxWidth > 0 && width > maxWidth) {
+    height = max<coord_t>(1, int64_t(height) * maxWidth / width);
+    width = maxWidth;
+  }
+  if (maxHeight > 0 && height > maxHeight) {
+    width = max<coord_t>(1, int64_t(width) * maxHeight / height);
+    height = maxHeight;
+  }
+  return width != srcWidth || height != srcHeight;
+}
+
+// Downscales the image being loaded: its rows come one after the other, in
+// any vertical order, as RGBA 8888 pixels, and each pixel of the bitmap is
+// the average of the box of source pixels it covers. Only the sums of the
+// current row of the bitmap are kept, so the memory needed does not depend
+// on the source height (when the rows are streamed from the file, as for
+// BMP). The bitmap becomes ARGB4444 when a translucent pixel is found
+class BitmapDownscaler
+{
+  public:
+    BitmapDownscaler(coord_t srcWidth, coord_t srcHeight, coord_t width, coord_t height, uint8_t format = BMP_RGB565):
+      srcHeight(srcHeight),
+      bitmap(BitmapBuffer::allocate(format, width, height)),
+      columns((uint16_t *)malloc(srcWidth * sizeof(uint16_t))),
+      counts((uint16_t *)calloc(width, sizeof(uint16_t))),
+      sums((uint64_t *)calloc(width * 4, sizeof(uint64_t)))
+    {
+      if (columns && counts) {
+        for (coord_t x = 0; x < srcWidth; x++) {
+          columns[x] = x * width / srcWidth;
+          counts[columns[x]]++;
+        }
+      }
+    }
+
+    ~BitmapDownscaler()
+    {
+      delete bitmap;
+      free(columns);
+      free(counts);
+      free(sums);
+    }
+
+    [[nodiscard]] bool isValid() const
+    {
+      return bitmap && columns && counts && sums;
+    }
+
+    void startRow(coord_t y)
+    {
+      coord_t row = y * bitmap->height() / srcHeight;
+      if (row != currentRow) {
+        flush();
+        currentRow = row;
+      }
+      rows++;
+    }
+
+    inline void addPixel(coord_t x, uint8_t r, uint8_t g, uint8_t b, uint8_t a = 0xFF)
+    {
+      // the colors are weighted by their alpha, as the box filter of drawBitmap()
+      auto s = &sums[columns[x] * 4];
+      s[0] += r * a;
+      s[1] += g * a;
+      s[2] += b * a;
+      s[3] += a;
+      if (a != 0xFF) {
+        translucent = true;
+      }
+    }
+
+    // Returns the bitmap, which then belongs to the caller
+    BitmapBuffer * finish()
+    {
+      flush();
+      auto result = bitmap;
+      bitmap = nullptr;
+      return result;
+    }
+
+  protected:
+    coord_t srcHeight;
+    BitmapBuffer * bitmap;
+    uint16_t * columns; // the column of the bitmap of each source column
+    uint16_t * counts; // the count of source columns of each bitmap column
+    uint64_t * sums; // 64 bits, a box may hold more than 66k pixels of 255 * 255
+    coord_t currentRow = -1;
+    coord_t rows = 0;
+    coord_t firstRow = -1; // the rows already written
+    coord_t lastRow = -1;
+    bool translucent = false;
+
+    void flush()
+    {
+      if (currentRow < 0 || rows == 0) {
+        return;
+      }
+
+      if (translucent && bitmap->getFormat() == BMP_RGB565) {
+        // the rows already written were opaque
+        bitmap->setFormat(BMP_ARGB4444);
+        for (coord_t y = firstRow; y >= 0 && y <= lastRow; y++) {
+          pixel_t * p = bitmap->getPixelPtrAbs(0, y);
+          for (coord_t x = 0; x < bitmap->width(); x++) {
+            *p = PixelFormat<BMP_ARGB4444>::fromRGB565(*p);
+            p = bitmap->getNextPixel(p);
+          }
+        }
+      }
+
+      bool alpha = (bitmap->getFormat() == BMP_ARGB4444);
+      pixel_t * p = bitmap->getPixelPtrAbs(0, currentRow);
+      for (coord_t x = 0; x < bitmap->width(); x++) {
+        auto s = &sums[x * 4];
+        uint32_t count = counts[x] * rows;
+        uint64_t a = s[3];
+        if (a == 0) {
+          *p = alpha ? 0 : RGB565(0, 0, 0);
+        }
+        else if (alpha) {
+          *p = ARGB4444((a + count / 2) / count, s[0] / a, s[1] / a, s[2] / a);
+        }
+        else {
+          *p = RGB565(s[0] / a, s[1] / a, s[2] / a);
+        }
+        p = bitmap->getNextPixel(p);
+      }
+
+      memset(sums, 0, bitmap->width() * 4 * sizeof(uint64_t));
+      rows = 0;
+      firstRow = (firstRow < 0 ? currentRow : min(firstRow, currentRow));
+      lastRow = max(lastRow, currentRow);
+    }
+};
+
 BitmapMask * BitmapMask::load(const char * filename, int maxSize)
 {
+  auto ext = getFileExtension(filename);
+  if (!ext || strcmp(ext, ".bmp")) {
+    return load_stb(filename, maxSize);
+  }
+
   BitmapBuffer * bitmap = BitmapBuffer::load(filename, maxSize);
   if (bitmap) {
     BitmapMask * result = BitmapMask::allocate(BMP_RGB565, bitmap->width(), bitmap->height());
@@ -1424,6 +2601,11 @@ BitmapMask * BitmapMask::load(const char * filename, int maxSize)
 
 BitmapBuffer * BitmapBuffer::loadMaskOnBackground(const char * filename, Color565 foreground, Color565 background, int maxSize)
 {
+  auto ext = getFileExtension(filename);
+  if (!ext || strcmp(ext, ".bmp")) {
+    return loadMaskOnBackground_stb(filename, foreground, background, maxSize);
+  }
+
   BitmapBuffer * result = nullptr;
   const auto * mask = BitmapMask::load(filename, maxSize);
   if (mask) {
@@ -1437,25 +2619,38 @@ BitmapBuffer * BitmapBuffer::loadMaskOnBackground(const char * filename, Color56
   return result;
 }
 
-BitmapBuffer * BitmapBuffer::load_bmp(const char * filename, int maxSize)
+// Size of the window through which load_bmp() reads the files
+constexpr size_t BMP_READER_BUFFER_SIZE = 4096;
+
+// Count of pixels converted at once by load_bmp(), their bytes always fit in
+// the half of the window which FileBufferedReader keeps available
+constexpr uint32_t BMP_ROW_CHUNK = 256;
+
+static const uint8_t * readBmp(FileBufferedReader & reader, size_t size)
+{
+  size_t count;
+  auto result = reader.read(size, &count);
+  return count == size ? result : nullptr;
+}
+
+static uint32_t getBmpRowBytes(uint32_t width, uint16_t depth)
+{
+  return (width * depth + 7) / 8;
+}
+
+BitmapBuffer * BitmapBuffer::load_bmp(const char * filename, int maxSize, coord_t maxWidth, coord_t maxHeight)
 {
   uint8_t palette[16];
-  
-  FileReader fileReader(filename);
-  auto dataSize = fileReader.size();
+
+  FileBufferedReader reader(filename, BMP_READER_BUFFER_SIZE);
+  auto dataSize = reader.size();
   if (maxSize >= 0 && (int)dataSize > maxSize) {
     TRACE("Bitmap::load(%s) failed: malloc refused", filename);
     return nullptr;
   }
 
-  auto data = fileReader.read();
-  if (!data) {
-    TRACE("Bitmap::load(%s) failed: read error", filename);
-    return nullptr;
-  }
-
-  auto buf = data;
-  if (dataSize < 18 || buf[0] != 'B' || buf[1] != 'M') {
+  auto buf = readBmp(reader, 18);
+  if (!buf || buf[0] != 'B' || buf[1] != 'M') {
     return nullptr;
   }
 
@@ -1464,7 +2659,7 @@ BitmapBuffer * BitmapBuffer::load_bmp(const char * filename, int maxSize)
   uint32_t ihsize = UINT32LE(buf + 14); /* extra header size */
 
   /* invalid extra header size */
-  if (ihsize + 14 > hsize) {
+  if (ihsize < 12 || ihsize + 14 > hsize) {
     return nullptr;
   }
 
@@ -1478,8 +2673,14 @@ BitmapBuffer * BitmapBuffer::load_bmp(const char * filename, int maxSize)
     return nullptr;
   }
 
-  buf += 14;
-  uint32_t w, h;
+  buf = readBmp(reader, ihsize - 4);
+  if (!buf) {
+    TRACE("Bitmap::load(%s) failed: read error", filename);
+    return nullptr;
+  }
+
+  uint32_t w;
+  int32_t h;
 
   switch (ihsize) {
     case 40: // windib
@@ -1487,14 +2688,14 @@ BitmapBuffer * BitmapBuffer::load_bmp(const char * filename, int maxSize)
     case 64: // OS/2 v2
     case 108: // windib v4
     case 124: // windib v5
-      w = UINT32LE(buf + 4);
-      h = UINT32LE(buf + 8);
-      buf += 12;
+      w = UINT32LE(buf);
+      h = (int32_t)UINT32LE(buf + 4);
+      buf += 8;
       break;
     case 12: // OS/2 v1
-      w = UINT16LE(buf + 4);
-      h = UINT16LE(buf + 6);
-      buf += 8;
+      w = UINT16LE(buf);
+      h = UINT16LE(buf + 2);
+      buf += 4;
       break;
     default:
       return nullptr;
@@ -1506,14 +2707,79 @@ BitmapBuffer * BitmapBuffer::load_bmp(const char * filename, int maxSize)
 
   uint16_t depth = UINT16LE(buf + 2);
 
+  /* a negative height is a top-down bitmap */
+  bool bottomUp = (h > 0);
+  if (!bottomUp) {
+    h = -h;
+  }
+
+  /* the palette is just before the pixels, the headers end at ihsize + 14 */
+  uint32_t position = ihsize + 14;
   if (depth == 4) {
-    buf = data + hsize - 64;
+    if (hsize < position + 64 || !reader.skip(hsize - 64 - position) || !(buf = readBmp(reader, 64))) {
+      return nullptr;
+    }
     for (uint8_t i = 0; i < 16; i++) {
       palette[i] = buf[4 * i];
     }
   }
+  else if (!reader.skip(hsize - position)) {
+    return nullptr;
+  }
+
+  if (depth != 1 && depth != 4 && depth != 16 && depth != 32) {
+    return nullptr;
+  }
+
+  // the rows are read one after the other, bottom-up bitmaps start with the
+  // last row, each one being padded to 4 bytes
+  uint32_t padding = ((getBmpRowBytes(w, depth) + 3) & ~3u) - getBmpRowBytes(w, depth);
+
+  coord_t width, height;
+  if (getLoadSize(w, h, maxWidth, maxHeight, width, height)) {
+    if (maxSize >= 0 && width * height * 2 > maxSize) {
+      TRACE("Bitmap::load(%s) failed: malloc refused", filename);
+      return nullptr;
+    }
+
+    BitmapDownscaler downscaler(w, h, width, height);
+    if (!downscaler.isValid()) {
+      TRACE("Bitmap::load(%s) failed: malloc error", filename);
+      return nullptr;
+    }
 
-  buf = data + hsize;
+    for (int32_t row = 0; depth != 1 && row < h; row++) {
+      downscaler.startRow(bottomUp ? h - 1 - row : row);
+      for (uint32_t x = 0; x < w; x += BMP_ROW_CHUNK) {
+        uint32_t count = min<uint32_t>(BMP_ROW_CHUNK, w - x);
+        buf = readBmp(reader, getBmpRowBytes(count, depth));
+        if (!buf) {
+          TRACE("Bitmap::load(%s) failed: read error", filename);
+          return nullptr;
+        }
+        for (uint32_t j = 0; j < count; j++) {
+          if (depth == 16) {
+            uint16_t pixel = UINT16LE(buf + 2 * j);
+            downscaler.addPixel(x + j, (pixel >> 8) & 0xF8, (pixel >> 3) & 0xFC, (pixel << 3) & 0xF8);
+          }
+          else if (depth == 32) {
+            uint32_t pixel = UINT32LE(buf + 4 * j);
+            downscaler.addPixel(x + j, pixel >> 24, (pixel >> 16) & 0xFF, (pixel >> 8) & 0xFF, pixel & 0xFF);
+          }
+          else {
+            uint8_t val = palette[(buf[j / 2] >> ((j & 1) ? 0 : 4)) & 0x0F];
+            downscaler.addPixel(x + j, val, val, val);
+          }
+        }
+      }
+      if (!reader.skip(padding) && row < h - 1) {
+        TRACE("Bitmap::load(%s) failed: read error", filename);
+        return nullptr;
+      }
+    }
+
+    return downscaler.finish();
+  }
 
   if (maxSize >= 0 && int(w * h * 2) > maxSize) {
     TRACE("Bitmap::load(%s) failed: malloc refused", filename);
@@ -1526,86 +2792,78 @@ BitmapBuffer * BitmapBuffer::load_bmp(const char * filename, int maxSize)
     return nullptr;
   }
 
-  uint32_t rowSize;
+  if (depth == 1) {
+    return bmp;
+  }
+
   bool hasAlpha = false;
 
-  switch (depth) {
-    case 16:
-      for (int i = h - 1; i >= 0; i--) {
-        pixel_t * dest = bmp->getPixelPtrAbs(0, i);
-        for (unsigned int j = 0; j < w; j++) {
-          *dest = UINT16LE(buf);
-          buf += 2;
-          dest = bmp->getNextPixel(dest);
-        }
-        if (w & 1) {
-          buf += 2;
-        }
+  for (int32_t row = 0; row < h; row++) {
+    coord_t y = bottomUp ? h - 1 - row : row;
+    pixel_t * dest = bmp->getPixelPtrAbs(0, y);
+    for (uint32_t x = 0; x < w; x += BMP_ROW_CHUNK) {
+      uint32_t count = min<uint32_t>(BMP_ROW_CHUNK, w - x);
+      buf = readBmp(reader, getBmpRowBytes(count, depth));
+      if (!buf) {
+        TRACE("Bitmap::load(%s) failed: read error", filename);
+        delete bmp;
+        return nullptr;
       }
-      break;
 
-    case 32:
-      for (int i = h - 1; i >= 0; i--) {
-        pixel_t * dest = bmp->getPixelPtrAbs(0, i);
-        for (unsigned int j = 0; j < w; j++) {
-          uint32_t pixel = UINT32LE(buf);
-          buf += 4;
-          // result = f_read(imgFile, (uint8_t *)&pixel, 4, &read);
-          // if (result != FR_OK || read != 4) {
-          //   f_close(imgFile);
-          //   free(imgFile);
-          //   delete bmp;
-          //   return nullptr;
-          // }
-          if (hasAlpha) {
-            *dest = ARGB4444((pixel >> 24) & 0xFF, (pixel >> 16) & 0xFF, (pixel >> 8) & 0xFF, (pixel >> 0) & 0xFF);
+      switch (depth) {
+        case 16:
+          for (uint32_t j = 0; j < count; j++) {
+            *dest = UINT16LE(buf);
+            buf += 2;
+            dest = bmp->getNextPixel(dest);
           }
-          else {
-            if ((pixel & 0xFF) == 0xFF) {
+          break;
+
+        case 32:
+          for (uint32_t j = 0; j < count; j++) {
+            uint32_t pixel = UINT32LE(buf);
+            buf += 4;
+            if (hasAlpha) {
+              *dest = ARGB4444(pixel & 0xFF, (pixel >> 24) & 0xFF, (pixel >> 16) & 0xFF, (pixel >> 8) & 0xFF);
+            }
+            else if ((pixel & 0xFF) == 0xFF) {
               *dest = RGB565(pixel >> 24, (pixel >> 16) & 0xFF, (pixel >> 8) & 0xFF);
             }
             else {
+              // the pixels already loaded were opaque RGB565 ones
               hasAlpha = true;
               bmp->setFormat(BMP_ARGB4444);
-              for (pixel_t * p = bmp->getPixelPtrAbs(j, i); p != dest; p = bmp->getNextPixel(p)) {
-                pixel_t tmp = *p;
-                *p = ((tmp >> 1) & 0x0f) + (((tmp >> 7) & 0x0f) << 4) + (((tmp >> 12) & 0x0f) << 8);
+              for (int32_t previous = 0; previous <= row; previous++) {
+                coord_t previousY = bottomUp ? h - 1 - previous : previous;
+                coord_t width = (previous < row ? w : x + j);
+                for (coord_t col = 0; col < width; col++) {
+                  pixel_t * p = bmp->getPixelPtrAbs(col, previousY);
+                  *p = PixelFormat<BMP_ARGB4444>::fromRGB565(*p);
+                }
               }
               *dest = ARGB4444(pixel & 0xFF, (pixel >> 24) & 0xFF, (pixel >> 16) & 0xFF, (pixel >> 8) & 0xFF);
             }
+            dest = bmp->getNextPixel(dest);
           }
-          dest = bmp->getNextPixel(dest);
-        }
-      }
-      break;
-
-    case 1:
-      break;
-
-    case 4:
-      rowSize = ((4*w+31)/32)*4;
-      for (int32_t i = h - 1; i >= 0; i--) {
-        // result = f_read(imgFile, buf, rowSize, &read);
-        // if (result != FR_OK || read != rowSize) {
-        //   f_close(imgFile);
-        //   free(imgFile);
-        //   delete bmp;
-        //   return nullptr;
-        // }
-        pixel_t * dest = bmp->getPixelPtrAbs(0, i);
-        for (uint32_t j = 0; j < w; j++) {
-          uint8_t index = (buf[j/2] >> ((j & 1) ? 0 : 4)) & 0x0F;
-          uint8_t val = palette[index];
-          *dest = RGB565(val, val, val);
-          dest = bmp->getNextPixel(dest);
-        }
-        buf += rowSize;
+          break;
+
+        case 4:
+          // BMP_ROW_CHUNK is even, a chunk always starts on a high nibble
+          for (uint32_t j = 0; j < count; j++) {
+            uint8_t index = (buf[j / 2] >> ((j & 1) ? 0 : 4)) & 0x0F;
+            uint8_t val = palette[index];
+            *dest = RGB565(val, val, val);
+            dest = bmp->getNextPixel(dest);
+          }
+          break;
       }
-      break;
+    }
 
-    default:
+    if (!reader.skip(padding) && row < h - 1) {
+      TRACE("Bitmap::load(%s) failed: read error", filename);
       delete bmp;
       return nullptr;
+    }
   }
 
   return bmp;
@@ -1662,98 +2920,293 @@ void * stb_realloc(void *ptr, unsigned int oldsz, unsigned int newsz)
 #define STB_IMAGE_IMPLEMENTATION
 #include "thirdparty/stb/stb_image.h"
 
-BitmapBuffer * BitmapBuffer::load_stb(const char * filename, int maxSize)
+// Number of rows converted at once by load_stb()
+constexpr int LOAD_TILE_HEIGHT = 8;
+
+// stb_image reads the file through FileBufferedReader, so that the file is
+// never loaded as a whole
+static int stbReadCallback(void * user, char * data, int size)
 {
-  int w, h, n;
-  unsigned char * img;
+  auto reader = (FileBufferedReader *)user;
+  int result = 0;
+  while (result < size) {
+    size_t count;
+    auto chunk = reader->read(size - result, &count);
+    if (count == 0) {
+      break;
+    }
+    memcpy(data + result, chunk, count);
+    result += count;
+  }
+  return result;
+}
 
-  {
-    FileReader fileReader(filename);
-    auto dataSize = fileReader.size();
+static void stbSkipCallback(void * user, int count)
+{
+  if (count > 0) {
+    ((FileBufferedReader *)user)->skip(count);
+  }
+}
 
-    if (dataSize == 0) {
-      return nullptr;
-    }
+static int stbEofCallback(void * user)
+{
+  return ((FileBufferedReader *)user)->eof();
+}
 
-    if (maxSize >= 0 && (int)dataSize > maxSize) {
-      TRACE("Bitmap::load(%s) failed: malloc refused", filename);
-      return nullptr;
-    }
+static const stbi_io_callbacks stbCallbacks = {
+  stbReadCallback,
+  stbSkipCallback,
+  stbEofCallback
+};
+
+static void convertStbSpan(pixel_t * dest, const uint8_t * src, int channels, bool alpha, int count)
+{
+  if (channels == 3)
+    blitRGB888ToRGB565Span(dest, src, count);
+  else if (alpha)
+    blitRGBA8888ToARGB4444Span(dest, src, count);
+  else
+    blitRGBA8888ToRGB565Span(dest, src, count);
+}
+
+// Decodes an image with desiredChannels channels, JPEG images being decoded
+// with 3 channels instead of 4 since they have no alpha. channels is set to
+// the count of channels of the result, n to the one of the file
+static unsigned char * decodeStbImage(const char * filename, int maxSize, int desiredChannels, int & w, int & h, int & n, int & channels)
+{
+  FileBufferedReader reader(filename);
+  auto dataSize = reader.size();
+
+  if (dataSize == 0) {
+    return nullptr;
+  }
+
+  if (maxSize >= 0 && (int)dataSize > maxSize) {
+    TRACE("Bitmap::load(%s) failed: malloc refused", filename);
+    return nullptr;
+  }
 
-    auto data = fileReader.read();
-    if (!data) {
+  channels = desiredChannels;
+  if (channels == 4) {
+    size_t count;
+    auto header = reader.read(2, &count);
+    if (count == 2 && header[0] == 0xFF && header[1] == 0xD8) {
+      channels = 3;
+    }
+    if (!reader.rewind()) {
       TRACE("Bitmap::load(%s) failed: read error", filename);
       return nullptr;
     }
+  }
 
-    img = stbi_load_from_memory(data, dataSize, &w, &h, &n, 4);
-    if (!img) {
-      TRACE("Bitmap::load(%s) failed: %s", filename, stbi_failure_reason());
-      return nullptr;
+  auto img = stbi_load_from_callbacks(&stbCallbacks, &reader, &w, &h, &n, channels);
+  if (!img) {
+    TRACE("Bitmap::load(%s) failed: %s", filename, stbi_failure_reason());
+    return nullptr;
+  }
+
+  return img;
+}
+
+// Converts the decoded rows into a bitmap of another layout: the pixels are
+// converted by tiles, which are then copied to the bitmap, so that a rotated
+// layout is not written column by column. convert(dest, src, count) converts
+// count pixels of a row
+template <class T, class Convert>
+static void convertByTiles(BitmapBufferBase<T> * bitmap, const uint8_t * img, int pixelSize, Convert && convert)
+{
+  coord_t w = bitmap->width();
+  coord_t h = bitmap->height();
+  auto & layout = bitmap->getPixelLayout();
+  T tile[LOAD_TILE_HEIGHT * BLIT_LINE_CHUNK];
+  for (int row = 0; row < h; row += LOAD_TILE_HEIGHT) {
+    int rows = min<int>(LOAD_TILE_HEIGHT, h - row);
+    for (int col = 0; col < w; col += BLIT_LINE_CHUNK) {
+      int cols = min<int>(BLIT_LINE_CHUNK, w - col);
+      for (int i = 0; i < rows; i++) {
+        convert(&tile[i * BLIT_LINE_CHUNK], img + ((row + i) * w + col) * pixelSize, cols);
+      }
+      blitCopyBlock(bitmap->getPixelPtrAbs(col, row), layout.xStep, layout.yStep, tile, 1, BLIT_LINE_CHUNK, cols, rows);
     }
+  }
+}
 
-    if (maxSize >= 0 && w * h * 2 > maxSize) {
+// The decoded image may become the bitmap when the LCD layout is row major,
+// its pixels being converted in place
+static bool isNaturalLcdLayout(coord_t w, coord_t h)
+{
+  auto layout = PixelLayout::lcd(w, h);
+  return layout.offset == 0 && layout.xStep == 1 && layout.yStep == w;
+}
+
+BitmapBuffer * BitmapBuffer::load_stb(const char * filename, int maxSize, coord_t maxWidth, coord_t maxHeight)
+{
+  int w, h, n, channels;
+  unsigned char * img = decodeStbImage(filename, maxSize, 4, w, h, n, channels);
+  if (!img) {
+    return nullptr;
+  }
+
+  bool alpha = (channels == 4 && n == 4);
+  uint8_t format = alpha ? BMP_ARGB4444 : BMP_RGB565;
+
+  // stb_image has no reduced resolution decoding, the decoded image is
+  // averaged by boxes into the smaller bitmap
+  coord_t width, height;
+  if (getLoadSize(w, h, maxWidth, maxHeight, width, height)) {
+    if (maxSize >= 0 && width * height * 2 > maxSize) {
       TRACE("Bitmap::load(%s) malloc not allowed", filename);
       stbi_image_free(img);
       return nullptr;
     }
+
+    BitmapDownscaler downscaler(w, h, width, height, format);
+    if (!downscaler.isValid()) {
+      TRACE("Bitmap::load(%s) malloc failed", filename);
+      stbi_image_free(img);
+      return nullptr;
+    }
+
+    const uint8_t * p = img;
+    for (int y = 0; y < h; y++) {
+      downscaler.startRow(y);
+      for (int x = 0; x < w; x++, p += channels) {
+        downscaler.addPixel(x, p[0], p[1], p[2], channels == 4 ? p[3] : 0xFF);
+      }
+    }
+
+    stbi_image_free(img);
+    return downscaler.finish();
+  }
+
+  if (maxSize >= 0 && w * h * 2 > maxSize) {
+    TRACE("Bitmap::load(%s) malloc not allowed", filename);
+    stbi_image_free(img);
+    return nullptr;
   }
 
   // convert to RGB565 or ARGB4444 format
-  auto bmp = BitmapBuffer::allocate(n == 4 ? BMP_ARGB4444 : BMP_RGB565, w, h);
+  auto convert = [&](pixel_t * dest, const uint8_t * src, int count) {
+    convertStbSpan(dest, src, channels, alpha, count);
+  };
+
+  if (isNaturalLcdLayout(w, h)) {
+    convert((pixel_t *)img, img, w * h);
+    auto data = (pixel_t *)realloc(img, align32(w * h * sizeof(pixel_t)));
+    if (data) {
+      img = (unsigned char *)data;
+    }
+    auto bmp = new BitmapBuffer(format, w, h, (pixel_t *)img);
+    bmp->dataAllocated = true;
+    return bmp;
+  }
+
+  auto bmp = BitmapBuffer::allocate(format, w, h);
   if (!bmp) {
     TRACE("Bitmap::load(%s) malloc failed", filename);
     stbi_image_free(img);
     return nullptr;
   }
 
-#if 0
-  DMABitmapConvert(bmp->data, img, w, h, n == 4 ? DMA2D_ARGB4444 : DMA2D_RGB565);
-#elif LCD_ORIENTATION == 270
-  const uint8_t * p = img;
-  if (n == 4) {
-    for (int row = 0; row < h; ++row) {
-      pixel_t * dest = bmp->getPixelPtrAbs(0, row);
-      for (int col = 0; col < w; ++col) {
-        *dest = ARGB4444(p[3], p[0], p[1], p[2]);
-        dest += bmp->height();
-        p += 4;
-      }
-    }
+  convertByTiles(bmp, img, channels, convert);
+  stbi_image_free(img);
+  return bmp;
+}
+
+// Masks are made of the alpha channel of the images which have one, of
+// their gray level otherwise, stb_image is asked for these 2 channels only
+constexpr int MASK_CHANNELS = 2;
+
+static inline uint8_t getMaskValue(const uint8_t * pixel, int n)
+{
+  uint8_t value = pixel[n == 4 ? 1 : 0];
+  return (ALPHA_MAX - (value >> 4)) << 4;
+}
+
+BitmapMask * BitmapMask::load_stb(const char * filename, int maxSize)
+{
+  int w, h, n, channels;
+  unsigned char * img = decodeStbImage(filename, maxSize, MASK_CHANNELS, w, h, n, channels);
+  if (!img) {
+    return nullptr;
   }
-  else {
-    for (int row = 0; row < h; ++row) {
-      pixel_t * dest = bmp->getPixelPtrAbs(0, row);
-      for (int col = 0; col < w; ++col) {
-        *dest = RGB565(p[0], p[1], p[2]);
-        dest += bmp->height();
-        p += 4;
-      }
-    }
+
+  if (maxSize >= 0 && w * h * 2 > maxSize) {
+    TRACE("Bitmap::load(%s) malloc not allowed", filename);
+    stbi_image_free(img);
+    return nullptr;
   }
-#else
-  pixel_t * dest = bmp->getPixelPtrAbs(0, 0);
-  const uint8_t * p = img;
-  if (n == 4) {
-    for (int row = 0; row < h; ++row) {
-      for (int col = 0; col < w; ++col) {
-        *dest = ARGB4444(p[3], p[0], p[1], p[2]);
-        dest = bmp->getNextPixel(dest);
-        p += 4;
-      }
+
+  auto convert = [&](uint8_t * dest, const uint8_t * src, int count) {
+    for (int i = 0; i < count; i++, src += MASK_CHANNELS) {
+      dest[i] = getMaskValue(src, n);
     }
+  };
+
+  if (isNaturalLcdLayout(w, h)) {
+    convert(img, img, w * h);
+    auto data = (uint8_t *)realloc(img, align32(w * h));
+    return new BitmapMask(BMP_RGB565, w, h, data ? data : img);
   }
-  else {
-    for (int row = 0; row < h; ++row) {
-      for (int col = 0; col < w; ++col) {
-        *dest = RGB565(p[0], p[1], p[2]);
-        dest = bmp->getNextPixel(dest);
-        p += 4;
-      }
+
+  auto mask = BitmapMask::allocate(BMP_RGB565, w, h);
+  if (!mask) {
+    TRACE("Bitmap::load(%s) malloc failed", filename);
+    stbi_image_free(img);
+    return nullptr;
+  }
+
+  convertByTiles(mask, img, MASK_CHANNELS, convert);
+  stbi_image_free(img);
+  return mask;
+}
+
+BitmapBuffer * BitmapBuffer::loadMaskOnBackground_stb(const char * filename, Color565 foreground, Color565 background, int maxSize)
+{
+  int w, h, n, channels;
+  unsigned char * img = decodeStbImage(filename, maxSize, MASK_CHANNELS, w, h, n, channels);
+  if (!img) {
+    return nullptr;
+  }
+
+  if (maxSize >= 0 && w * h * 2 > maxSize) {
+    TRACE("Bitmap::load(%s) malloc not allowed", filename);
+    stbi_image_free(img);
+    return nullptr;
+  }
+
+  // drawMask() only uses the 4 high bits of the mask values, the 16 colors
+  // it would draw over the background are computed once with its kernel
+  pixel_t colors[ALPHA_MAX + 1];
+  uint8_t values[ALPHA_MAX + 1];
+  for (uint8_t i = 0; i <= ALPHA_MAX; i++) {
+    colors[i] = background;
+    values[i] = (ALPHA_MAX - i) << 4;
+  }
+  blitAlphaMaskSpan(colors, false, values, ALPHA_MAX + 1, foreground);
+
+  auto convert = [&](pixel_t * dest, const uint8_t * src, int count) {
+    for (int i = 0; i < count; i++, src += MASK_CHANNELS) {
+      dest[i] = colors[src[n == 4 ? 1 : 0] >> 4];
     }
+  };
+
+  // the 2 channels of a pixel are replaced by its RGB565 value
+  if (isNaturalLcdLayout(w, h)) {
+    convert((pixel_t *)img, img, w * h);
+    auto bmp = new BitmapBuffer(BMP_RGB565, w, h, (pixel_t *)img);
+    bmp->dataAllocated = true;
+    return bmp;
+  }
+
+  auto bmp = BitmapBuffer::allocate(BMP_RGB565, w, h);
+  if (!bmp) {
+    TRACE("Bitmap::load(%s) malloc failed", filename);
+    stbi_image_free(img);
+    return nullptr;
   }
-#endif
 
+  convertByTiles(bmp, img, MASK_CHANNELS, convert);
   stbi_image_free(img);
   return bmp;
 }
@@ -23,11 +23,13 @@
 #include <cstring>
 #include <cmath>
 #include "bitmapdata.h"
+#include "blit_kernels.h"
 #include "libopenui_types.h"
 #include "libopenui_defines.h"
 #include "libopenui_depends.h"
 #include "libopenui_helpers.h"
 #include "font.h"
+#include "intconversions.h"
 #include "debug.h"
 
 constexpr uint8_t SOLID = 0xFF;
@@ -40,12 +42,311 @@ constexpr uint8_t DASHED = 0x33;
 
 extern char * numberToString(int32_t val, uint8_t len, const char * prefix, const char * suffix, LcdFlags flags);
 
+// Size of the buffers of formatNumber(): 16 chars for the prefix, 16 chars
+// for the number and 16 chars for the suffix
+constexpr uint8_t NUMBER_BUFFER_SIZE = 48 + 1;
+
+// Reentrant version of numberToString() writing in buffer, the text being cut
+// to its size. Returns the length of the text
+extern int formatNumber(char * buffer, int size, int32_t val, LcdFlags flags = 0, const char * prefix = nullptr, const char * suffix = nullptr);
+
+// Width of the text of formatNumber(), the digits having the width of '9'
+extern coord_t getNumberWidth(int32_t val, LcdFlags flags = 0, const char * prefix = nullptr, const char * suffix = nullptr);
+
 typedef uint16_t pixel_t;
 
+// Number of pixels handled at once by the line based blits
+constexpr coord_t BLIT_LINE_CHUNK = 64;
+
 enum BitmapFormat
 {
   BMP_RGB565,
-  BMP_ARGB4444
+  BMP_ARGB4444,
+  // palette indexed, only used by the encoded bitmaps (IndexedBitmapData)
+  BMP_INDEXED8,
+  BMP_INDEXED4
+};
+
+// Filter used when a bitmap is scaled or rotated
+enum BitmapFilter
+{
+  BMP_FILTER_NEAREST,
+  BMP_FILTER_BOX, // averages the source pixels when downscaling
+  BMP_FILTER_BILINEAR // interpolates the 4 nearest source pixels when rotating
+};
+
+// Transform applied by drawBitmap() and drawMask() while the pixels are
+// copied. The rotations are clockwise
+enum BitmapTransform
+{
+  BMP_TRANSFORM_NONE = 0,
+  BMP_FLIP_HORIZONTAL = 0x01,
+  BMP_FLIP_VERTICAL = 0x02,
+  BMP_TRANSPOSE = 0x04, // swaps x and y, applied before the flips
+  BMP_ROTATE_90 = BMP_TRANSPOSE | BMP_FLIP_VERTICAL,
+  BMP_ROTATE_180 = BMP_FLIP_HORIZONTAL | BMP_FLIP_VERTICAL,
+  BMP_ROTATE_270 = BMP_TRANSPOSE | BMP_FLIP_HORIZONTAL
+};
+
+// Compile-time pixel format policies, the drawing loops are specialized for
+// each destination / source format instead of testing the format per pixel
+template <uint8_t FORMAT>
+struct PixelFormat;
+
+template <>
+struct PixelFormat<BMP_RGB565>
+{
+  static constexpr bool hasAlpha = false;
+
+  static inline pixel_t fromRGB565(Color565 color)
+  {
+    return color;
+  }
+
+  static inline uint8_t getAlpha(pixel_t)
+  {
+    return ALPHA_MAX;
+  }
+
+  static inline Color565 toRGB565(pixel_t value)
+  {
+    return value;
+  }
+
+  // Box filter: channels sums of a block of pixels, then their average
+  static inline void accumulate(uint32_t * sums, pixel_t value)
+  {
+    RGB_SPLIT(value, r, g, b);
+    sums[0] += r;
+    sums[1] += g;
+    sums[2] += b;
+  }
+
+  static inline pixel_t average(const uint32_t * sums, uint32_t count)
+  {
+    return RGB_JOIN(sums[0] / count, sums[1] / count, sums[2] / count);
+  }
+
+  // Bilinear filter: interpolation between 2 pixels, weight being the one
+  // of b in 1/256
+  static inline pixel_t lerp(pixel_t a, pixel_t b, uint8_t weight)
+  {
+    RGB_SPLIT(a, ar, ag, ab);
+    RGB_SPLIT(b, br, bg, bb);
+    return RGB_JOIN(ar + (((br - ar) * weight) >> 8), ag + (((bg - ag) * weight) >> 8), ab + (((bb - ab) * weight) >> 8));
+  }
+
+  static inline pixel_t blend(pixel_t bg, uint8_t alpha, Color565 color)
+  {
+    uint8_t bgAlpha = ALPHA_MAX - alpha;
+    RGB_SPLIT(color, red, green, blue);
+    RGB_SPLIT(bg, bgRed, bgGreen, bgBlue);
+    uint16_t r = (bgRed * bgAlpha + red * alpha) / ALPHA_MAX;
+    uint16_t g = (bgGreen * bgAlpha + green * alpha) / ALPHA_MAX;
+    uint16_t b = (bgBlue * bgAlpha + blue * alpha) / ALPHA_MAX;
+    return RGB_JOIN(r, g, b);
+  }
+};
+
+template <>
+struct PixelFormat<BMP_ARGB4444>
+{
+  static constexpr bool hasAlpha = true;
+
+  static inline pixel_t fromRGB565(Color565 color)
+  {
+    return RGB565_TO_ARGB4444(color, 0xFF);
+  }
+
+  static inline uint8_t getAlpha(pixel_t value)
+  {
+    return value >> 12;
+  }
+
+  static inline Color565 toRGB565(pixel_t value)
+  {
+    return ((value & 0x0F00) << 4) + ((value & 0x00F0) << 3) + ((value & 0x000F) << 1);
+  }
+
+  // The colors are weighted by their alpha, so that transparent pixels do
+  // not darken the edges
+  static inline void accumulate(uint32_t * sums, pixel_t value)
+  {
+    ARGB_SPLIT(value, a, r, g, b);
+    sums[0] += a * r;
+    sums[1] += a * g;
+    sums[2] += a * b;
+    sums[3] += a;
+  }
+
+  static inline pixel_t average(const uint32_t * sums, uint32_t count)
+  {
+    uint32_t a = sums[3];
+    if (a == 0)
+      return 0;
+    return ARGB_JOIN((a + count / 2) / count, sums[0] / a, sums[1] / a, sums[2] / a);
+  }
+
+  static inline pixel_t lerp(pixel_t a, pixel_t b, uint8_t weight)
+  {
+    ARGB_SPLIT(a, aa, ar, ag, ab);
+    ARGB_SPLIT(b, ba, br, bg, bb);
+    uint32_t wa = aa * (256 - weight);
+    uint32_t wb = ba * weight;
+    uint32_t sum = wa + wb;
+    if (sum == 0)
+      return 0;
+    return ARGB_JOIN((sum + 128) >> 8, (ar * wa + br * wb) / sum, (ag * wa + bg * wb) / sum, (ab * wa + bb * wb) / sum);
+  }
+
+  static inline pixel_t blend(pixel_t bg, uint8_t alpha, Color565 color)
+  {
+    if (alpha == ALPHA_MAX)
+      return fromRGB565(color);
+
+    if (alpha == 0)
+      return bg;
+
+    // https://en.wikipedia.org/wiki/Alpha_compositing
+    ARGB_SPLIT(bg, bgAlpha, bgRed, bgGreen, bgBlue);
+    if (bgAlpha == 0)
+      return RGB565_TO_ARGB4444(color, alpha << 4);
+
+    RGB_SPLIT(color, red, green, blue);
+    red >>= 1;
+    green >>= 2;
+    blue >>= 1;
+    uint16_t a = alpha + (bgAlpha * (ALPHA_MAX - alpha)) / ALPHA_MAX;
+    uint16_t r = min<uint8_t>(0x0F, (red * alpha + bgRed * bgAlpha) / a);
+    uint16_t g = min<uint8_t>(0x0F, (green * alpha + bgGreen * bgAlpha) / a);
+    uint16_t b = min<uint8_t>(0x0F, (blue * alpha + bgBlue * bgAlpha) / a);
+    return ARGB_JOIN(a, r, g, b);
+  }
+};
+
+// Draws pixels of the SRC format over pixels of the DEST format
+template <class DEST, class SRC>
+struct PixelPainter
+{
+  static inline pixel_t draw(pixel_t bg, pixel_t value)
+  {
+    if constexpr (!SRC::hasAlpha)
+      return DEST::fromRGB565(value);
+    else
+      return DEST::blend(bg, SRC::getAlpha(value), SRC::toRGB565(value));
+  }
+};
+
+// Bilinear filter of the 8 bit masks
+inline uint8_t lerpMask(uint8_t a, uint8_t b, uint8_t weight)
+{
+  return a + (((b - a) * weight) >> 8);
+}
+
+// Calls function with the PixelFormat matching the runtime format, so that
+// the loops inside function are compiled once per format
+template <class Function>
+inline void dispatchPixelFormat(uint8_t format, Function && function)
+{
+  if (format == BMP_ARGB4444)
+    function(PixelFormat<BMP_ARGB4444>());
+  else
+    function(PixelFormat<BMP_RGB565>());
+}
+
+// Storage of the pixels of a bitmap, fixed when the bitmap is constructed:
+// the pixel (x, y) is stored at offset + x * xStep + y * yStep
+struct PixelLayout
+{
+  int offset;
+  int xStep;
+  int yStep;
+
+  // The LCD frame buffer layout, which is also the one of the encoded bitmaps
+  // and the one expected by the DMA* hooks
+  static PixelLayout lcd([[maybe_unused]] coord_t width, [[maybe_unused]] coord_t height, [[maybe_unused]] bool frameBuffer = false)
+  {
+#if LCD_ORIENTATION == 180
+    return {width * height - 1, -1, -width};
+#elif LCD_ORIENTATION == 270
+  #if defined(LTDC_OFFSET_X)
+    if (frameBuffer)
+      return {LTDC_OFFSET_X, height + LTDC_OFFSET_X, 1};
+  #endif
+    return {0, height, 1};
+#else
+    return {0, 1, width};
+#endif
+  }
+
+  [[nodiscard]] inline int getOffset(coord_t x, coord_t y) const
+  {
+    return offset + x * xStep + y * yStep;
+  }
+
+  bool operator == (const PixelLayout & other) const
+  {
+    return offset == other.offset && xStep == other.xStep && yStep == other.yStep;
+  }
+};
+
+// Walks along a row or a column of a bitmap
+template <class T>
+struct PixelIterator
+{
+  T * pixel;
+  int step;
+
+  inline T & operator * () const
+  {
+    return *pixel;
+  }
+
+  inline T & operator [] (int index) const
+  {
+    return pixel[index * step];
+  }
+
+  inline PixelIterator & operator ++ ()
+  {
+    pixel += step;
+    return *this;
+  }
+
+  inline PixelIterator operator + (int count) const
+  {
+    return {pixel + count * step, step};
+  }
+};
+
+// Integer stepping through the source pixels of a bitmap rotated around its
+// center: the pixels of a destination row are mapped to 16.16 fixed point
+// source positions by adding (dx, dy) at each step
+class BitmapRotation
+{
+  public:
+    BitmapRotation(float radians, coord_t width, coord_t height, bool bilinear);
+
+    struct Row
+    {
+      coord_t first; // the pixels [first, last) of the row have a source pixel
+      coord_t last;
+      int32_t x; // source position of the pixel 0 of the row
+      int32_t y;
+    };
+
+    [[nodiscard]] Row getRow(coord_t row) const;
+
+    int32_t dx;
+    int32_t dy;
+    bool bilinear;
+
+  protected:
+    coord_t width;
+    int32_t originX;
+    int32_t originY;
+    int32_t limitX;
+    int32_t limitY;
 };
 
 template<class T>
@@ -61,6 +362,7 @@ class BitmapBufferBase
       data(data),
       dataEnd(data + (width * height))
     {
+      initLayout();
     }
 
     BitmapBufferBase(uint8_t format, T * data):
@@ -72,6 +374,7 @@ class BitmapBufferBase
       data((T *)(((uint16_t *)data) + 2)),
       dataEnd((T *)(((uint16_t *)data) + 2) + (_width * _height))
     {
+      initLayout();
     }
 
     [[nodiscard]] inline bool isValid() const
@@ -180,232 +483,158 @@ class BitmapBufferBase
       return _width * _height * sizeof(T);
     }
 
+
+    [[nodiscard]] inline const PixelLayout & getPixelLayout() const
+    {
+      return layout;
+    }
+
     inline T * getNextPixel(T * pixel, coord_t count = 1)
     {
-#if LCD_ORIENTATION == 180
-      return pixel - count;
-#elif LCD_ORIENTATION == 270
-      coord_t lineHeight = _height;
-  #if defined(LTDC_OFFSET_X)
-      if (isLcdFrameBuffer(data)) {
-        lineHeight += LTDC_OFFSET_X;
-      }
-  #endif
-      auto result = pixel + (count * lineHeight);
-      while (result > dataEnd)
-        result -= lineHeight - 1;
-      return result;
-#else
-      return pixel + count;
-#endif
+      return pixel + count * layout.xStep;
     }
 
     inline const T * getNextPixel(const T * pixel, coord_t count = 1) const
     {
-#if LCD_ORIENTATION == 180
-      return pixel - count;
-#elif LCD_ORIENTATION == 270
-      coord_t lineHeight = _height;
-  #if defined(LTDC_OFFSET_X)
-      if (isLcdFrameBuffer(data)) {
-        lineHeight += LTDC_OFFSET_X;
-      }
-  #endif
-      auto result = pixel + (count * lineHeight);
-      while (result > dataEnd)
-        result -= lineHeight - 1;
-      return result;
-#else
-      return pixel + count;
-#endif
+      return pixel + count * layout.xStep;
     }
 
     inline T * getPixelPtrAbs(coord_t x, coord_t y)
     {
-#if LCD_ORIENTATION == 180
-      x = _width - x - 1;
-      y = _height - y - 1;
-#elif LCD_ORIENTATION == 270
-  #if defined(LTDC_OFFSET_X)
-      if (isLcdFrameBuffer(data))
-        return &data[x * (_height + LTDC_OFFSET_X) + y + LTDC_OFFSET_X];
-      else
-        return &data[x * (_height) + y];
-  #else
-      return &data[x * (_height) + y];
-  #endif
-#endif
-      return &data[y * _width + x];
+      return &data[layout.getOffset(x, y)];
     }
 
     [[nodiscard]] inline const T * getPixelPtrAbs(coord_t x, coord_t y) const
     {
-#if LCD_ORIENTATION == 180
-      x = _width - x - 1;
-      y = _height - y - 1;
-#elif LCD_ORIENTATION == 270
-  #if defined(LTDC_OFFSET_X)
-      if (isLcdFrameBuffer(data))
-        return &data[x * (_height + LTDC_OFFSET_X) + y + LTDC_OFFSET_X];
-      else
-        return &data[x * (_height) + y];
-  #else
-      return &data[x * (_height) + y];
-  #endif
-#endif
-      return &data[y * _width + x];
+      return &data[layout.getOffset(x, y)];
+    }
+
+    inline PixelIterator<T> getRow(coord_t x, coord_t y)
+    {
+      return {getPixelPtrAbs(x, y), layout.xStep};
+    }
+
+    [[nodiscard]] inline PixelIterator<const T> getRow(coord_t x, coord_t y) const
+    {
+      return {getPixelPtrAbs(x, y), layout.xStep};
+    }
+
+    inline PixelIterator<T> getColumn(coord_t x, coord_t y)
+    {
+      return {getPixelPtrAbs(x, y), layout.yStep};
+    }
+
+    [[nodiscard]] inline PixelIterator<const T> getColumn(coord_t x, coord_t y) const
+    {
+      return {getPixelPtrAbs(x, y), layout.yStep};
     }
 
     template <class C>
     C * horizontalFlip() const
     {
-      auto * result = C::allocate(format, width(), height());
-      if (!result) {
-        return nullptr;
-      }
-
-#if LCD_ORIENTATION == 270
-      for (uint8_t y = 0; y < height(); y++) {
-        for (uint8_t x = 0; x < width(); x++) {
-          auto * destData = &result->data[x * height() + y];
-          auto * srcData = &data[(width() - 1 - x) * height() + y];
-          *destData = *srcData;
-        }
-      }
-#else
-      auto * srcData = data + width();
-      auto * destData = result->data;
-      for (uint8_t y = 0; y < height(); y++) {
-        for (uint8_t x = 0; x < width(); x++) {
-          *(destData++) = *(--srcData);
-        }
-        srcData += 2 * width();
-      }
-#endif
-      return result;
+      return transform<C>(width(), height(), getPixelPtrAbs(width() - 1, 0), -layout.xStep, layout.yStep);
     }
 
     template <class C>
     C * verticalFlip() const
     {
-      auto * result = C::allocate(format, width(), height());
-      if (!result) {
-        return nullptr;
-      }
-      
-#if LCD_ORIENTATION == 270
-      for (uint8_t y = 0; y < height(); y++) {
-        for (uint8_t x = 0; x < width(); x++) {
-          auto * destData = &result->data[x * height() + y];
-          auto * srcData = &data[x * height() + height() - 1 - y];
-          *destData = *srcData;
-        }
-      }
-#else
-      auto * srcData = getDataEnd() - width();
-      auto * destData = result->data;
-      for (uint8_t y = 0; y < height(); y++) {
-        for (uint8_t x = 0; x < width(); x++) {
-          *(destData++) = *(srcData++);
-        }
-        srcData -= 2 * width();
-      }
-#endif
-      return result;
+      return transform<C>(width(), height(), getPixelPtrAbs(0, height() - 1), layout.xStep, -layout.yStep);
     }
 
+    // Rotates around the center, the pixels without source are cleared
     template <class C>
-    C * rotate(float radians) const
+    C * rotate(float radians, BitmapFilter filter = BMP_FILTER_NEAREST) const
     {
-      float sine = sinf(radians);
-      float cosine = cosf(radians);
-
       auto w = width();
       auto h = height();
 
-      auto x0 = w / 2;
-      auto y0 = h / 2;
-
       auto * result = C::allocate(format, w, h);
       if (!result) {
         return nullptr;
       }
 
-      auto * srcData = data;
-      auto * destData = result->data;
-
-      for (unsigned rX = 0; rX < w; rX++) {
-        coord_t dX = rX - x0;
-        for (unsigned rY = 0; rY < h; rY++) {
-          coord_t dY = rY - y0;
-          coord_t x = round(dX * cosine + dY * sine + x0);
-          if (x >= 0 && x < w) {
-            coord_t y = round(dY * cosine - dX * sine + y0);
-            if (y >= 0 && y < h) {
-              destData[rY * w + rX] = srcData[y * w + x];
-            }
-            else {
-              destData[rY * w + rX] = 0;
-            }
-          }
-          else {
-            destData[rY * w + rX] = 0;
-          }
+      BitmapRotation rotation(radians, w, h, filter == BMP_FILTER_BILINEAR);
+      for (coord_t i = 0; i < h; i++) {
+        auto p = result->getRow(0, i);
+        auto row = rotation.getRow(i);
+        for (coord_t j = 0; j < row.first; j++) {
+          p[j] = 0;
+        }
+        samplePixels(p + row.first, row.x + row.first * rotation.dx, row.y + row.first * rotation.dy, rotation.dx, rotation.dy, row.last - row.first, rotation.bilinear);
+        for (coord_t j = row.last; j < w; j++) {
+          p[j] = 0;
         }
       }
 
       return result;
     }
 
-    template <class C>
-    C * rotate90() const
+    // Writes to output the count pixels found from the 16.16 fixed point
+    // position (x, y) by steps of (dx, dy), all inside the bitmap
+    template <class Output>
+    void samplePixels(Output output, int32_t x, int32_t y, int32_t dx, int32_t dy, coord_t count, bool bilinear) const
     {
-      auto * result = C::allocate(format, height(), width());
-      if (!result) {
-        return nullptr;
-      }
-
-  #if LCD_ORIENTATION == 270
-      auto * srcData = data;
-      auto * destData = result->data;
-      for (uint8_t y = 0; y < width(); y++) {
-        for (uint8_t x = 0; x < height(); x++) {
-          destData[x * width() + y] = srcData[y * height() + x];
+      if (!bilinear) {
+        for (coord_t i = 0; i < count; i++, x += dx, y += dy) {
+          output[i] = data[layout.getOffset(x >> 16, y >> 16)];
         }
       }
-  #else
-      auto * destData = result->data + height();
-      for (uint8_t y = 0; y < width(); y++) {
-        auto * srcData = data + y;
-        for (uint8_t x = 0; x < height(); x++) {
-          destData--;
-          *destData = *srcData;
-          srcData += width();
-        }
-        destData += 2 * height();
+      else if constexpr (sizeof(T) == 1) {
+        interpolatePixels(output, x, y, dx, dy, count, lerpMask);
+      }
+      else {
+        dispatchPixelFormat(format, [&](auto pixelFormat) {
+          using FORMAT = decltype(pixelFormat);
+          interpolatePixels(output, x, y, dx, dy, count, [](pixel_t a, pixel_t b, uint8_t weight) {
+            return FORMAT::lerp(a, b, weight);
+          });
+        });
       }
-  #endif
-      return result;
+    }
+
+    // Rotates clockwise
+    template <class C>
+    C * rotate90() const
+    {
+      return transform<C>(height(), width(), getPixelPtrAbs(0, height() - 1), -layout.yStep, layout.xStep);
     }
 
     template <class C>
     C * rotate180() const
     {
-      auto * result = C::allocate(format, width(), height());
-      if (!result) {
-        return nullptr;
-      }
+      return transform<C>(width(), height(), getPixelPtrAbs(width() - 1, height() - 1), -layout.xStep, -layout.yStep);
+    }
 
-      auto * srcData = data;
-      auto * destData = result->dataEnd;
-      while (destData > result->data) {
-        *(--destData) = *srcData++;
+  protected:
+    template <class Output, class Lerp>
+    void interpolatePixels(Output output, int32_t x, int32_t y, int32_t dx, int32_t dy, coord_t count, Lerp && lerp) const
+    {
+      for (coord_t i = 0; i < count; i++, x += dx, y += dy) {
+        coord_t srcx = x >> 16;
+        coord_t srcy = y >> 16;
+        uint8_t fx = x >> 8;
+        uint8_t fy = y >> 8;
+        // the last column and row are their own neighbours
+        int xStep = srcx < _width - 1 ? layout.xStep : 0;
+        int yStep = srcy < _height - 1 ? layout.yStep : 0;
+        auto q = getPixelPtrAbs(srcx, srcy);
+        output[i] = lerp(lerp(q[0], q[xStep], fx), lerp(q[yStep], q[xStep + yStep], fx), fy);
       }
+    }
 
+    // Returns a w x h copy of this bitmap, the pixel (x, y) of the copy being
+    // the one at origin + x * xStep + y * yStep
+    template <class C>
+    C * transform(coord_t w, coord_t h, const T * origin, int xStep, int yStep) const
+    {
+      auto * result = C::allocate(format, w, h);
+      if (result) {
+        auto & resultLayout = result->getPixelLayout();
+        blitCopyBlock(result->getPixelPtrAbs(0, 0), resultLayout.xStep, resultLayout.yStep, origin, xStep, yStep, w, h);
+      }
       return result;
     }
 
-  protected:
     uint8_t format;
     coord_t _width;
     coord_t _height;
@@ -417,11 +646,233 @@ class BitmapBufferBase
     coord_t offsetY = 0;
     T * data;
     T * dataEnd;
+    PixelLayout layout;
+
+    void initLayout()
+    {
+#if LCD_ORIENTATION == 270 && defined(LTDC_OFFSET_X)
+      layout = PixelLayout::lcd(_width, _height, isLcdFrameBuffer(data));
+#else
+      layout = PixelLayout::lcd(_width, _height);
+#endif
+    }
 };
 
 typedef BitmapBufferBase<const uint16_t> Bitmap;
 typedef BitmapBufferBase<const uint8_t> StaticMask;
 
+// Streaming decoders of the compressed bitmaps and masks, P being the
+// pixel type. Both decode the lines of the LCD layout (rows, or columns when
+// the LCD is rotated) with the same interface:
+// - startLine(line) before the first pixel of a line which is decoded
+// - getRunLength() count of the next pixels which all are getRunPixel()
+// - endLine(count) after the line, count pixels of it being left
+
+// The RLE of tools/encode-bitmap.py --rle: a byte found twice in a row is
+// followed by the count of its next repetitions. It has to be decoded from
+// the start, and only runs of the pixels made of one repeated byte are seen
+template <class P>
+class RLEDecoder
+{
+  public:
+    typedef P Pixel;
+
+    RLEDecoder(const uint8_t * src, coord_t):
+      src(src)
+    {
+    }
+
+    inline uint8_t getByte()
+    {
+      if (runCount > 0) {
+        runCount--;
+        return runByte;
+      }
+
+      uint8_t byte = *src++;
+      if (prevByteValid && byte == prevByte) {
+        runByte = byte;
+        runCount = *src++;
+        prevByteValid = false;
+      }
+      else {
+        prevByte = byte;
+        prevByteValid = true;
+      }
+      return byte;
+    }
+
+    inline void startLine(coord_t)
+    {
+    }
+
+    inline P getPixel()
+    {
+      if constexpr (sizeof(P) == 1) {
+        return getByte();
+      }
+      else {
+        uint16_t low = getByte();
+        return low + (getByte() << 8);
+      }
+    }
+
+    [[nodiscard]] inline coord_t getRunLength() const
+    {
+      return runCount / sizeof(P);
+    }
+
+    [[nodiscard]] inline P getRunPixel() const
+    {
+      return sizeof(P) == 1 ? runByte : runByte * 0x0101;
+    }
+
+    inline void skipRun(coord_t count)
+    {
+      runCount -= count * sizeof(P);
+    }
+
+    void skip(coord_t count)
+    {
+      skipBytes(count * sizeof(P));
+    }
+
+    void endLine(coord_t count)
+    {
+      skipBytes(count * sizeof(P));
+    }
+
+  protected:
+    const uint8_t * src;
+    uint8_t prevByte = 0;
+    bool prevByteValid = false;
+    uint8_t runByte = 0;
+    uint8_t runCount = 0;
+
+    void skipBytes(uint32_t count)
+    {
+      while (count > 0) {
+        if (runCount > 0) {
+          auto n = min<uint32_t>(count, runCount);
+          runCount -= n;
+          count -= n;
+        }
+        else {
+          getByte();
+          count--;
+        }
+      }
+    }
+};
+
+// The pixel RLE of tools/encode-bitmap.py --pixel-rle: the offset of each
+// line (uint32 LE, from the end of this index), then the packets of the
+// lines. A packet header h is followed by one pixel repeated (h & 0x7F) + 1
+// times when h & 0x80, else by h + 1 literal pixels. The lines are
+// independent, so the lines which are not drawn are never read
+template <class P>
+class PixelRLEDecoder
+{
+  public:
+    typedef P Pixel;
+
+    PixelRLEDecoder(const uint8_t * data, coord_t lines):
+      index(data),
+      packets(data + lines * sizeof(uint32_t))
+    {
+    }
+
+    inline void startLine(coord_t line)
+    {
+      src = packets + UINT32LE(index + line * sizeof(uint32_t));
+      runLength = 0;
+      literalLength = 0;
+    }
+
+    inline P getPixel()
+    {
+      fetch();
+      if (runLength > 0) {
+        runLength--;
+        return runValue;
+      }
+      literalLength--;
+      return read();
+    }
+
+    inline coord_t getRunLength()
+    {
+      fetch();
+      return runLength;
+    }
+
+    [[nodiscard]] inline P getRunPixel() const
+    {
+      return runValue;
+    }
+
+    inline void skipRun(coord_t count)
+    {
+      runLength -= count;
+    }
+
+    void skip(coord_t count)
+    {
+      while (count > 0) {
+        fetch();
+        if (runLength > 0) {
+          auto n = min(count, runLength);
+          runLength -= n;
+          count -= n;
+        }
+        else {
+          auto n = min(count, literalLength);
+          src += n * sizeof(P);
+          literalLength -= n;
+          count -= n;
+        }
+      }
+    }
+
+    inline void endLine(coord_t)
+    {
+    }
+
+  protected:
+    const uint8_t * index;
+    const uint8_t * packets;
+    const uint8_t * src = nullptr;
+    coord_t runLength = 0;
+    coord_t literalLength = 0;
+    P runValue = 0;
+
+    inline P read()
+    {
+      if constexpr (sizeof(P) == 1) {
+        return *src++;
+      }
+      else {
+        P value = UINT16LE(src);
+        src += sizeof(P);
+        return value;
+      }
+    }
+
+    inline void fetch()
+    {
+      if (runLength == 0 && literalLength == 0) {
+        uint8_t header = *src++;
+        if (header & 0x80) {
+          runLength = (header & 0x7F) + 1;
+          runValue = read();
+        }
+        else {
+          literalLength = header + 1;
+        }
+      }
+    }
+};
+
 class RLEBitmap: public BitmapBufferBase<uint16_t>
 {
   public:
@@ -434,6 +885,7 @@ class RLEBitmap: public BitmapBufferBase<uint16_t>
       data = (uint16_t*)malloc(align32(pixels * sizeof(uint16_t)));
       decode((uint8_t *)data, pixels * sizeof(uint16_t), rleData + 4);
       dataEnd = data + pixels;
+      initLayout();
     }
 
     ~RLEBitmap()
@@ -494,6 +946,12 @@ class BitmapMask: public BitmapBufferBase<uint8_t>
     {
     }
 
+    // Takes the ownership of data, allocated with malloc()
+    BitmapMask(uint8_t format, uint16_t width, uint16_t height, uint8_t * data):
+      BitmapBufferBase<uint8_t>(format, width, height, data)
+    {
+    }
+
   public:
     ~BitmapMask()
     {
@@ -518,12 +976,68 @@ class BitmapMask: public BitmapBufferBase<uint8_t>
     }
 
     static BitmapMask * load(const char * filename, int maxSize = -1);
+
+  protected:
+    static BitmapMask * load_stb(const char * filename, int maxSize = -1);
+};
+
+// Copy of a mask with 4 bits per pixel (see PackedBitmapData), half the size
+// of the BitmapMask
+class PackedMask
+{
+  public:
+    static PackedMask * pack(const BitmapMask * mask);
+
+    ~PackedMask()
+    {
+      free(data);
+    }
+
+    [[nodiscard]] inline uint16_t width() const
+    {
+      return data->width();
+    }
+
+    [[nodiscard]] inline uint16_t height() const
+    {
+      return data->height();
+    }
+
+    [[nodiscard]] inline const PackedBitmapData * getData() const
+    {
+      return data;
+    }
+
+  protected:
+    explicit PackedMask(PackedBitmapData * data):
+      data(data)
+    {
+    }
+
+    PackedBitmapData * data;
+};
+
+class TextLayout;
+
+// Number of glyphs drawn at once by drawSizedText()
+constexpr uint8_t GLYPH_RUN_SIZE = 16;
+
+// Glyphs of a text cut from the same mask, waiting to be drawn together (with
+// one DMACopyAlphaMasks() call when DMA_COPY_ALPHA_MASKS is defined)
+struct GlyphRun
+{
+  const uint8_t * mask = nullptr;
+  coord_t maskWidth = 0;
+  coord_t maskHeight = 0;
+  Color565 color = 0;
+  uint8_t count = 0;
+  DMAMaskRect rects[GLYPH_RUN_SIZE];
 };
 
 class BitmapBuffer: public BitmapBufferBase<pixel_t>
 {
   public:
-    static BitmapBuffer * allocate(uint8_t format, uint16_t width, uint16_t height) 
+    static BitmapBuffer * allocate(uint8_t format, uint16_t width, uint16_t height)
     {
       auto result = new BitmapBuffer(format, width, height);
       if (result && !result->isValid()) {
@@ -550,11 +1064,28 @@ class BitmapBuffer: public BitmapBufferBase<pixel_t>
 
     inline void setFormat(uint8_t format)
     {
+      nextGeneration();
       this->format = format;
     }
 
+    // Identifies the content of the bitmap for the caches, it changes when a
+    // bitmap is allocated and each time it is drawn on or its format changes.
+    // The pixels written through getData(), drawPixel() or drawAlphaPixel()
+    // need a call to nextGeneration(), once they are all drawn
+    [[nodiscard]] inline uint32_t getGeneration() const
+    {
+      return generation;
+    }
+
+    // To be called when the pixels of a bitmap which may be cached changed
+    void nextGeneration()
+    {
+      generation = ++lastGeneration;
+    }
+
     inline void clear(Color565 color = 0 /*black*/)
     {
+      nextGeneration();
       fillRectangle(0, 0, _width - offsetX, _height - offsetY, color);
     }
 
@@ -631,7 +1162,7 @@ class BitmapBuffer: public BitmapBufferBase<pixel_t>
 
     void drawPlainFilledCircle(coord_t x, coord_t y, coord_t radius, Color565 color);
 
-    void drawAnnulusSector(coord_t x, coord_t y, coord_t internalRadius, coord_t externalRadius, LcdColor color, int startAngle, int endAngle);
+    void drawAnnulusSector(coord_t x, coord_t y, coord_t internalRadius, coord_t externalRadius, LcdColor color, int startAngle, int endAngle, bool antiAliasing = false);
 
     void drawBitmapPie(int x0, int y0, const uint16_t * img, int startAngle, int endAngle);
 
@@ -639,13 +1170,43 @@ class BitmapBuffer: public BitmapBufferBase<pixel_t>
 
     static BitmapBuffer * load(const char * filename, int maxSize = -1);
 
+    // Loads an image reduced to fit in maxWidth x maxHeight, its aspect ratio
+    // being kept, the pixels being averaged by boxes. Only BMP files are
+    // reduced while they are read: PNG and JPEG images are still decoded at
+    // their full size first, so their peak memory use is not lower
+    static BitmapBuffer * load(const char * filename, coord_t maxWidth, coord_t maxHeight);
+
     static BitmapBuffer * loadMaskOnBackground(const char * filename, Color565 foreground, Color565 background, int maxSize = -1);
 
     template <class T>
-    void drawMask(coord_t x, coord_t y, const T * mask, Color565 color, coord_t srcx = 0, coord_t srcy = 0, coord_t srcw = 0, coord_t srch = 0);
+    void drawMask(coord_t x, coord_t y, const T * mask, Color565 color, coord_t srcx = 0, coord_t srcy = 0, coord_t srcw = 0, coord_t srch = 0, BitmapTransform transform = BMP_TRANSFORM_NONE);
 
     void drawMask(coord_t x, coord_t y, const BitmapMask * mask, const BitmapBuffer * srcBitmap, coord_t offsetX = 0, coord_t offsetY = 0, coord_t width = 0, coord_t height = 0);
 
+    void drawMask(coord_t x, coord_t y, const PackedBitmapData * mask, Color565 color, coord_t srcx = 0, coord_t srcy = 0, coord_t srcw = 0, coord_t srch = 0);
+
+    void drawMask(coord_t x, coord_t y, const PackedMask * mask, Color565 color, coord_t srcx = 0, coord_t srcy = 0, coord_t srcw = 0, coord_t srch = 0)
+    {
+      if (mask) {
+        drawMask(x, y, mask->getData(), color, srcx, srcy, srcw, srch);
+      }
+    }
+
+    // Draw the RLE encoded data of a bitmap (see RLEBitmap) or of a mask,
+    // decoding it on the fly instead of keeping a decoded copy
+    void drawRLEBitmap(coord_t x, coord_t y, uint8_t bitmapFormat, const uint8_t * rleData);
+
+    void drawRLEMask(coord_t x, coord_t y, const uint8_t * rleData, Color565 color);
+
+    // Same with the pixel RLE data (see PixelRLEDecoder), only the visible
+    // lines are decoded
+    void drawPixelRLEBitmap(coord_t x, coord_t y, uint8_t bitmapFormat, const uint8_t * rleData);
+
+    void drawPixelRLEMask(coord_t x, coord_t y, const uint8_t * rleData, Color565 color);
+
+    // The palette values are expanded while they are drawn
+    void drawIndexedBitmap(coord_t x, coord_t y, const IndexedBitmapData * bmp);
+
     coord_t drawSizedText(coord_t x, coord_t y, const char * s, uint8_t len, LcdColor color, LcdFlags flags = 0);
 
     coord_t drawText(coord_t x, coord_t y, const char * s, LcdColor color, LcdFlags flags = 0)
@@ -653,6 +1214,10 @@ class BitmapBuffer: public BitmapBufferBase<pixel_t>
       return drawSizedText(x, y, s, 0, color, flags);
     }
 
+    // Draws a text laid out before with the flags of the layout, each line
+    // being aligned on its own, interline pixels apart
+    coord_t drawTextLayout(coord_t x, coord_t y, const TextLayout & layout, LcdColor color, coord_t interline = 0);
+
     coord_t drawTextAtIndex(coord_t x, coord_t y, const char * s, uint8_t idx, LcdColor color, LcdFlags flags = 0)
     {
       char length = *s++;
@@ -662,19 +1227,26 @@ class BitmapBuffer: public BitmapBufferBase<pixel_t>
     coord_t drawNumber(coord_t x, coord_t y, int32_t val, LcdColor color, LcdFlags flags = 0, uint8_t len = 0, const char * prefix = nullptr, const char * suffix = nullptr);
 
     template<class T>
-    void drawBitmap(coord_t x, coord_t y, const T * bmp, coord_t srcx = 0, coord_t srcy = 0, coord_t srcw = 0, coord_t srch = 0, float scale = 0);
+    void drawBitmap(coord_t x, coord_t y, const T * bmp, coord_t srcx = 0, coord_t srcy = 0, coord_t srcw = 0, coord_t srch = 0, float scale = 0, BitmapFilter filter = BMP_FILTER_NEAREST, BitmapTransform transform = BMP_TRANSFORM_NONE);
 
     void copyFrom(const BitmapBuffer * other)
     {
+      nextGeneration();
       DMACopyBitmap(getData(), _width, _height, 0, 0, other->getData(), _width, _height, 0, 0, _width, _height);
     }
 
     template<class T>
-    void drawScaledBitmap(const T * bitmap, coord_t x, coord_t y, coord_t w, coord_t h);
+    void drawScaledBitmap(const T * bitmap, coord_t x, coord_t y, coord_t w, coord_t h, BitmapFilter filter = BMP_FILTER_NEAREST);
+
+    // Draws bmp rotated by radians around its center, in the rect of its size
+    // at (x, y). The pixels without source are left untouched
+    template<class T>
+    void drawRotatedBitmap(coord_t x, coord_t y, const T * bmp, float radians, BitmapFilter filter = BMP_FILTER_NEAREST);
 
   protected:
-    static BitmapBuffer * load_bmp(const char * filename, int maxSize = -1);
-    static BitmapBuffer * load_stb(const char * filename, int maxSize = -1);
+    static BitmapBuffer * load_bmp(const char * filename, int maxSize = -1, coord_t maxWidth = 0, coord_t maxHeight = 0);
+    static BitmapBuffer * load_stb(const char * filename, int maxSize = -1, coord_t maxWidth = 0, coord_t maxHeight = 0);
+    static BitmapBuffer * loadMaskOnBackground_stb(const char * filename, Color565 foreground, Color565 background, int maxSize = -1);
 
     inline bool applyClippingRect(coord_t & x, coord_t & y, coord_t & w, coord_t & h) const
     {
@@ -718,6 +1290,12 @@ class BitmapBuffer: public BitmapBufferBase<pixel_t>
 
     uint8_t drawChar(coord_t x, coord_t y, const Font::Glyph & glyph, LcdColor color);
 
+    // Adds the glyph to the run when it is visible, flushing the run first
+    // when the glyph comes from another mask or would evict its mask
+    uint8_t drawGlyph(GlyphRun & run, coord_t x, coord_t y, const Font::Glyph & glyph, Color565 color);
+
+    void flushGlyphRun(GlyphRun & run);
+
     inline void drawPixel(pixel_t * p, pixel_t value)
     {
       if (data && data <= p && p < dataEnd) {
@@ -752,6 +1330,29 @@ class BitmapBuffer: public BitmapBufferBase<pixel_t>
 
     void drawHorizontalLineAbs(coord_t x, coord_t y, coord_t w, LcdColor color, uint8_t pat = SOLID);
 
+    // Fills count pixels of one row or one column
+    void fillPixels(PixelIterator<pixel_t> p, coord_t count, pixel_t value);
+
+    // Blends count pixels of one row or one column
+    void blendPixels(PixelIterator<pixel_t> p, coord_t count, uint8_t alpha, Color565 color);
+
+    // Draws count source pixels to one row or one column
+    template <class DEST, class SRC>
+    void drawPixelsLine(PixelIterator<pixel_t> p, const pixel_t * line, coord_t count);
+
+    // Draws count times the same source pixel to one row or one column
+    template <class DEST, class SRC>
+    void drawPixelsRun(PixelIterator<pixel_t> p, pixel_t value, coord_t count);
+
+    template <class Decoder, class Literals, class Run>
+    void drawRLE(coord_t x, coord_t y, const uint8_t * rleData, Literals && drawLiterals, Run && drawRun);
+
+    template <template <class> class Decoder>
+    void drawRLEBitmap(coord_t x, coord_t y, uint8_t bitmapFormat, const uint8_t * rleData);
+
+    template <template <class> class Decoder>
+    void drawRLEMask(coord_t x, coord_t y, const uint8_t * rleData, Color565 color);
+
     void fillRectangle(coord_t x, coord_t y, coord_t w, coord_t h, pixel_t color);
 
     void fillBottomFlatTriangle(coord_t x0, coord_t y0, coord_t x1, coord_t y1, coord_t x2, LcdColor color);
@@ -759,6 +1360,8 @@ class BitmapBuffer: public BitmapBufferBase<pixel_t>
 
   private:
     bool dataAllocated;
+    uint32_t generation;
+    static uint32_t lastGeneration;
 #if defined(DEBUG)
     bool leakReported = false;
 #endif
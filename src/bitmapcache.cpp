@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) OpenTX
+ *
+ * Source:
+ *  https://github.com/opentx/libopenui
+ *
+ * This file is a part of libopenui library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+
+#include "bitmapcache.h"
+
+ScaledBitmapCache scaledBitmapCache;
+
+const BitmapBuffer * ScaledBitmapCache::get(const BitmapBuffer * source, coord_t w, coord_t h, BitmapFilter filter)
+{
+  if (budget == 0) {
+    return nullptr;
+  }
+
+  for (auto it = entries.begin(); it != entries.end();) {
+    if (it->source != source) {
+      ++it;
+    }
+    else if (it->generation != source->getGeneration()) {
+      // the source was drawn on since this copy was scaled
+      usedBytes -= it->bitmap->getDataSize();
+      delete it->bitmap;
+      it = entries.erase(it);
+    }
+    else if (it->width == w && it->height == h && it->format == source->getFormat() && it->filter == filter) {
+      entries.splice(entries.begin(), entries, it);
+      hits++;
+      return it->bitmap;
+    }
+    else {
+      ++it;
+    }
+  }
+
+  misses++;
+
+  auto scale = source->getScale(w, h);
+  coord_t scaledw = min<coord_t>(w, ceilf(scale * source->width()));
+  coord_t scaledh = min<coord_t>(h, ceilf(scale * source->height()));
+  uint32_t size = scaledw * scaledh * sizeof(pixel_t);
+  if (size == 0 || size > budget) {
+    return nullptr;
+  }
+
+  // the entries are only evicted once the copy could be allocated
+  auto bitmap = BitmapBuffer::allocate(source->getFormat(), scaledw, scaledh);
+  if (!bitmap) {
+    return nullptr;
+  }
+
+  evict(size);
+
+  // the pixels with alpha are blended, they need a transparent background
+  if (source->getFormat() == BMP_ARGB4444) {
+    bitmap->clear();
+  }
+  bitmap->drawBitmap(0, 0, source, 0, 0, 0, 0, scale, filter);
+  entries.push_front({source, source->getGeneration(), w, h, source->getFormat(), filter, bitmap});
+  usedBytes += size;
+  return bitmap;
+}
+
+void ScaledBitmapCache::invalidate(const BitmapBuffer * source)
+{
+  for (auto it = entries.begin(); it != entries.end();) {
+    if (it->source == source) {
+      usedBytes -= it->bitmap->getDataSize();
+      delete it->bitmap;
+      it = entries.erase(it);
+    }
+    else {
+      ++it;
+    }
+  }
+}
+
+void ScaledBitmapCache::clear()
+{
+  for (auto & entry: entries) {
+    delete entry.bitmap;
+  }
+  entries.clear();
+  usedBytes = 0;
+}
+
+void ScaledBitmapCache::evict(uint32_t size)
+{
+  while (!entries.empty() && usedBytes + size > budget) {
+    auto & entry = entries.back();
+    usedBytes -= entry.bitmap->getDataSize();
+    delete entry.bitmap;
+    entries.pop_back();
+  }
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) OpenTX
+ *
+ * Source:
+ *  https://github.com/opentx/libopenui
+ *
+ * This file is a part of libopenui library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+
+#pragma once
+
+#include <list>
+#include "bitmapbuffer.h"
+
+// Bounded cache of scaled copies of bitmaps, used by drawScaledBitmap() so
+// that a bitmap is only resampled again when its target size changes.
+// Entries are keyed on the source bitmap and its generation, the target size,
+// the source format and the filter, and are evicted in LRU order once the
+// byte budget is exceeded. The cache is disabled while the budget is 0.
+class ScaledBitmapCache
+{
+  public:
+    ~ScaledBitmapCache()
+    {
+      clear();
+    }
+
+    void setBudget(uint32_t value)
+    {
+      budget = value;
+      evict(0);
+    }
+
+    [[nodiscard]] uint32_t getBudget() const
+    {
+      return budget;
+    }
+
+    [[nodiscard]] uint32_t getUsedBytes() const
+    {
+      return usedBytes;
+    }
+
+    [[nodiscard]] uint32_t getHits() const
+    {
+      return hits;
+    }
+
+    [[nodiscard]] uint32_t getMisses() const
+    {
+      return misses;
+    }
+
+    void resetCounters()
+    {
+      hits = 0;
+      misses = 0;
+    }
+
+    // Returns the source bitmap scaled to fit in w x h, keeping its aspect
+    // ratio, or nullptr when it doesn't fit in the budget (the caller then
+    // scales the bitmap itself)
+    const BitmapBuffer * get(const BitmapBuffer * source, coord_t w, coord_t h, BitmapFilter filter);
+
+    // Drops the scaled copies of source
+    void invalidate(const BitmapBuffer * source);
+
+    void clear();
+
+  protected:
+    struct Entry
+    {
+      const BitmapBuffer * source;
+      uint32_t generation;
+      coord_t width;
+      coord_t height;
+      uint8_t format;
+      BitmapFilter filter;
+      BitmapBuffer * bitmap;
+    };
+
+    std::list<Entry> entries; // most recently used first
+    uint32_t budget = 0;
+    uint32_t usedBytes = 0;
+    uint32_t hits = 0;
+    uint32_t misses = 0;
+
+    // Evicts the least recently used entries until size more bytes fit
+    void evict(uint32_t size);
+};
+
+extern ScaledBitmapCache scaledBitmapCache;
@@ -42,3 +42,77 @@ struct BitmapData
     return data;
   }
 };
+
+// Encoded mask with 4 bits per pixel (see tools/encode-bitmap.py): 2 pixels
+// per byte, the low nibble first, each line of the LCD layout starting on a
+// new byte
+struct PackedBitmapData
+{
+  uint16_t _width;
+  uint16_t _height;
+  uint8_t data[];
+
+  uint16_t width() const
+  {
+    return _width;
+  }
+
+  uint16_t height() const
+  {
+    return _height;
+  }
+
+  const uint8_t * getData() const
+  {
+    return data;
+  }
+};
+
+// Palette indexed bitmap (see tools/encode-bitmap.py): the palette values
+// have the paletteFormat (BMP_RGB565 or BMP_ARGB4444), then come the indexes
+// of the lines of the LCD layout, 8 bits or 4 bits (the low nibble first)
+// per pixel, each line starting on a new byte
+struct IndexedBitmapData
+{
+  uint16_t _width;
+  uint16_t _height;
+  uint8_t format;
+  uint8_t paletteFormat;
+  uint16_t paletteSize;
+  uint16_t palette[];
+
+  uint16_t width() const
+  {
+    return _width;
+  }
+
+  uint16_t height() const
+  {
+    return _height;
+  }
+
+  uint8_t getFormat() const
+  {
+    return format;
+  }
+
+  uint8_t getPaletteFormat() const
+  {
+    return paletteFormat;
+  }
+
+  uint16_t getPaletteSize() const
+  {
+    return paletteSize;
+  }
+
+  const uint16_t * getPalette() const
+  {
+    return palette;
+  }
+
+  const uint8_t * getIndexes() const
+  {
+    return (const uint8_t *)(palette + paletteSize);
+  }
+};
@@ -0,0 +1,990 @@
+/*
+ * Copyright (C) OpenTX
+ *
+ * Source:
+ *  https://github.com/opentx/libopenui
+ *
+ * This file is a part of libopenui library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <cstring>
+#include <utility>
+#include "blit_kernels.h"
+#include "libopenui_defines.h"
+
+#if !defined(BLIT_KERNELS_SCALAR)
+  #if defined(__AVX2__)
+    #define BLIT_KERNELS_AVX2
+    #include <immintrin.h>
+  #endif
+  #if defined(__SSE2__) || defined(_M_X64)
+    #define BLIT_KERNELS_SSE2
+    #include <emmintrin.h>
+  #endif
+  #if defined(__SSSE3__)
+    #define BLIT_KERNELS_SSSE3
+    #include <tmmintrin.h>
+  #endif
+  #if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    #define BLIT_KERNELS_NEON
+    #include <arm_neon.h>
+  #endif
+#endif
+
+// (x * DIV_ALPHA_MAX) >> 16 == x / ALPHA_MAX for any x < 4694
+constexpr uint16_t DIV_ALPHA_MAX = 4370;
+
+// Division bias for the float reciprocal paths: exact quotients must not be
+// truncated one unit down, and 1/64 stays below the 1/15 quotient granularity
+constexpr float DIV_BIAS = 1.0f / 64;
+
+static inline uint16_t blendRGB565(uint16_t bg, uint8_t alpha, uint16_t red, uint16_t green, uint16_t blue)
+{
+  uint8_t bgAlpha = ALPHA_MAX - alpha;
+  RGB_SPLIT(bg, bgRed, bgGreen, bgBlue);
+  uint16_t r = (bgRed * bgAlpha + red * alpha) / ALPHA_MAX;
+  uint16_t g = (bgGreen * bgAlpha + green * alpha) / ALPHA_MAX;
+  uint16_t b = (bgBlue * bgAlpha + blue * alpha) / ALPHA_MAX;
+  return RGB_JOIN(r, g, b);
+}
+
+static inline uint16_t blendARGB4444(uint16_t bg, uint8_t alpha, uint16_t red, uint16_t green, uint16_t blue)
+{
+  if (alpha == ALPHA_MAX)
+    return ARGB_JOIN(ALPHA_MAX, red, green, blue);
+
+  if (alpha == 0)
+    return bg;
+
+  // https://en.wikipedia.org/wiki/Alpha_compositing
+  ARGB_SPLIT(bg, bgAlpha, bgRed, bgGreen, bgBlue);
+  if (bgAlpha == 0)
+    return ARGB_JOIN(alpha, red, green, blue);
+
+  uint16_t a = alpha + (bgAlpha * (ALPHA_MAX - alpha)) / ALPHA_MAX;
+  uint16_t r = min<uint16_t>(0x0F, (red * alpha + bgRed * bgAlpha) / a);
+  uint16_t g = min<uint16_t>(0x0F, (green * alpha + bgGreen * bgAlpha) / a);
+  uint16_t b = min<uint16_t>(0x0F, (blue * alpha + bgBlue * bgAlpha) / a);
+  return ARGB_JOIN(a, r, g, b);
+}
+
+static inline uint16_t opaqueARGB4444(uint16_t color)
+{
+  return 0xF000 + ((color >> 12) << 8) + (((color >> 7) & 0x0F) << 4) + ((color >> 1) & 0x0F);
+}
+
+// Blends one color at one alpha over many pixels: the color split and the
+// divisions are done once, the per pixel work is only multiply and shift
+template <bool DEST_ALPHA>
+class ColorBlender
+{
+  public:
+    ColorBlender(uint8_t alpha, uint16_t color):
+      alpha(alpha)
+    {
+      RGB_SPLIT(color, r, g, b);
+      if constexpr (DEST_ALPHA) {
+        r >>= 1;
+        g >>= 2;
+        b >>= 1;
+        // with a constant foreground alpha, the result alpha and its
+        // reciprocal only depend on the background alpha
+        for (uint8_t bgAlpha = 0; bgAlpha <= ALPHA_MAX; bgAlpha++) {
+          uint16_t a = alpha + (bgAlpha * (ALPHA_MAX - alpha)) / ALPHA_MAX;
+          resultAlpha[bgAlpha] = a;
+          reciprocal[bgAlpha] = a ? (65535 + a) / a : 0;
+        }
+      }
+      red = r * alpha;
+      green = g * alpha;
+      blue = b * alpha;
+    }
+
+    inline uint16_t blend(uint16_t bg) const
+    {
+      if constexpr (DEST_ALPHA) {
+        ARGB_SPLIT(bg, bgAlpha, bgRed, bgGreen, bgBlue);
+        uint32_t inv = reciprocal[bgAlpha];
+        uint16_t r = min<uint16_t>(0x0F, ((red + bgRed * bgAlpha) * inv) >> 16);
+        uint16_t g = min<uint16_t>(0x0F, ((green + bgGreen * bgAlpha) * inv) >> 16);
+        uint16_t b = min<uint16_t>(0x0F, ((blue + bgBlue * bgAlpha) * inv) >> 16);
+        return ARGB_JOIN(resultAlpha[bgAlpha], r, g, b);
+      }
+      else {
+        uint8_t bgAlpha = ALPHA_MAX - alpha;
+        RGB_SPLIT(bg, bgRed, bgGreen, bgBlue);
+        uint16_t r = ((bgRed * bgAlpha + red) * DIV_ALPHA_MAX) >> 16;
+        uint16_t g = ((bgGreen * bgAlpha + green) * DIV_ALPHA_MAX) >> 16;
+        uint16_t b = ((bgBlue * bgAlpha + blue) * DIV_ALPHA_MAX) >> 16;
+        return RGB_JOIN(r, g, b);
+      }
+    }
+
+    uint8_t alpha;
+    uint16_t red;
+    uint16_t green;
+    uint16_t blue;
+    uint16_t resultAlpha[ALPHA_MAX + 1];
+    uint32_t reciprocal[ALPHA_MAX + 1];
+};
+
+#if defined(BLIT_KERNELS_AVX2)
+// red, green and blue are already multiplied by the foreground alpha
+static inline __m256i blendPremultipliedRGB565_AVX2(__m256i bg, __m256i bgAlpha, __m256i red, __m256i green, __m256i blue)
+{
+  const __m256i div = _mm256_set1_epi16(DIV_ALPHA_MAX);
+  __m256i bgRed = _mm256_srli_epi16(bg, 11);
+  __m256i bgGreen = _mm256_and_si256(_mm256_srli_epi16(bg, 5), _mm256_set1_epi16(0x3F));
+  __m256i bgBlue = _mm256_and_si256(bg, _mm256_set1_epi16(0x1F));
+  __m256i r = _mm256_mulhi_epu16(_mm256_add_epi16(_mm256_mullo_epi16(bgRed, bgAlpha), red), div);
+  __m256i g = _mm256_mulhi_epu16(_mm256_add_epi16(_mm256_mullo_epi16(bgGreen, bgAlpha), green), div);
+  __m256i b = _mm256_mulhi_epu16(_mm256_add_epi16(_mm256_mullo_epi16(bgBlue, bgAlpha), blue), div);
+  return _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi16(r, 11), _mm256_slli_epi16(g, 5)), b);
+}
+
+static inline __m256i blendRGB565_AVX2(__m256i bg, __m256i alpha, __m256i red, __m256i green, __m256i blue)
+{
+  __m256i bgAlpha = _mm256_sub_epi16(_mm256_set1_epi16(ALPHA_MAX), alpha);
+  return blendPremultipliedRGB565_AVX2(bg, bgAlpha, _mm256_mullo_epi16(red, alpha), _mm256_mullo_epi16(green, alpha), _mm256_mullo_epi16(blue, alpha));
+}
+#endif
+
+#if defined(BLIT_KERNELS_SSE2)
+static inline __m128i selectSSE2(__m128i mask, __m128i a, __m128i b)
+{
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static inline __m128i joinARGB4444_SSE2(__m128i a, __m128i r, __m128i g, __m128i b)
+{
+  return _mm_or_si128(_mm_or_si128(_mm_slli_epi16(a, 12), _mm_slli_epi16(r, 8)), _mm_or_si128(_mm_slli_epi16(g, 4), b));
+}
+
+// red, green and blue are already multiplied by the foreground alpha
+static inline __m128i blendPremultipliedRGB565_SSE2(__m128i bg, __m128i bgAlpha, __m128i red, __m128i green, __m128i blue)
+{
+  const __m128i div = _mm_set1_epi16(DIV_ALPHA_MAX);
+  __m128i bgRed = _mm_srli_epi16(bg, 11);
+  __m128i bgGreen = _mm_and_si128(_mm_srli_epi16(bg, 5), _mm_set1_epi16(0x3F));
+  __m128i bgBlue = _mm_and_si128(bg, _mm_set1_epi16(0x1F));
+  __m128i r = _mm_mulhi_epu16(_mm_add_epi16(_mm_mullo_epi16(bgRed, bgAlpha), red), div);
+  __m128i g = _mm_mulhi_epu16(_mm_add_epi16(_mm_mullo_epi16(bgGreen, bgAlpha), green), div);
+  __m128i b = _mm_mulhi_epu16(_mm_add_epi16(_mm_mullo_epi16(bgBlue, bgAlpha), blue), div);
+  return _mm_or_si128(_mm_or_si128(_mm_slli_epi16(r, 11), _mm_slli_epi16(g, 5)), b);
+}
+
+static inline __m128i blendRGB565_SSE2(__m128i bg, __m128i alpha, __m128i red, __m128i green, __m128i blue)
+{
+  __m128i bgAlpha = _mm_sub_epi16(_mm_set1_epi16(ALPHA_MAX), alpha);
+  return blendPremultipliedRGB565_SSE2(bg, bgAlpha, _mm_mullo_epi16(red, alpha), _mm_mullo_epi16(green, alpha), _mm_mullo_epi16(blue, alpha));
+}
+
+static inline __m128i divideSSE2(__m128i value, __m128 invLo, __m128 invHi)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128 bias = _mm_set1_ps(DIV_BIAS);
+  __m128i lo = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(value, zero)), invLo), bias));
+  __m128i hi = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(value, zero)), invHi), bias));
+  return _mm_packs_epi32(lo, hi);
+}
+
+static inline __m128i blendARGB4444_SSE2(__m128i bg, __m128i alpha, __m128i red, __m128i green, __m128i blue)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i nibble = _mm_set1_epi16(0x0F);
+  const __m128 one = _mm_set1_ps(1.0f);
+  __m128i bgAlpha = _mm_srli_epi16(bg, 12);
+  __m128i bgRed = _mm_and_si128(_mm_srli_epi16(bg, 8), nibble);
+  __m128i bgGreen = _mm_and_si128(_mm_srli_epi16(bg, 4), nibble);
+  __m128i bgBlue = _mm_and_si128(bg, nibble);
+  __m128i a = _mm_add_epi16(alpha, _mm_mulhi_epu16(_mm_mullo_epi16(bgAlpha, _mm_sub_epi16(nibble, alpha)), _mm_set1_epi16(DIV_ALPHA_MAX)));
+  __m128 invLo = _mm_div_ps(one, _mm_cvtepi32_ps(_mm_unpacklo_epi16(a, zero)));
+  __m128 invHi = _mm_div_ps(one, _mm_cvtepi32_ps(_mm_unpackhi_epi16(a, zero)));
+  __m128i r = _mm_min_epi16(nibble, divideSSE2(_mm_add_epi16(_mm_mullo_epi16(red, alpha), _mm_mullo_epi16(bgRed, bgAlpha)), invLo, invHi));
+  __m128i g = _mm_min_epi16(nibble, divideSSE2(_mm_add_epi16(_mm_mullo_epi16(green, alpha), _mm_mullo_epi16(bgGreen, bgAlpha)), invLo, invHi));
+  __m128i b = _mm_min_epi16(nibble, divideSSE2(_mm_add_epi16(_mm_mullo_epi16(blue, alpha), _mm_mullo_epi16(bgBlue, bgAlpha)), invLo, invHi));
+  __m128i result = selectSSE2(_mm_cmpeq_epi16(alpha, nibble), joinARGB4444_SSE2(nibble, red, green, blue), joinARGB4444_SSE2(a, r, g, b));
+  return selectSSE2(_mm_cmpeq_epi16(alpha, zero), bg, result);
+}
+#endif
+
+#if defined(BLIT_KERNELS_NEON)
+static inline uint16x8_t divideAlphaMaxNEON(uint16x8_t value)
+{
+  uint32x4_t lo = vmull_n_u16(vget_low_u16(value), DIV_ALPHA_MAX);
+  uint32x4_t hi = vmull_n_u16(vget_high_u16(value), DIV_ALPHA_MAX);
+  return vcombine_u16(vshrn_n_u32(lo, 16), vshrn_n_u32(hi, 16));
+}
+
+static inline uint16x8_t joinARGB4444_NEON(uint16x8_t a, uint16x8_t r, uint16x8_t g, uint16x8_t b)
+{
+  return vorrq_u16(vorrq_u16(vshlq_n_u16(a, 12), vshlq_n_u16(r, 8)), vorrq_u16(vshlq_n_u16(g, 4), b));
+}
+
+// red, green and blue are already multiplied by the foreground alpha
+static inline uint16x8_t blendPremultipliedRGB565_NEON(uint16x8_t bg, uint16x8_t bgAlpha, uint16x8_t red, uint16x8_t green, uint16x8_t blue)
+{
+  uint16x8_t bgRed = vshrq_n_u16(bg, 11);
+  uint16x8_t bgGreen = vandq_u16(vshrq_n_u16(bg, 5), vdupq_n_u16(0x3F));
+  uint16x8_t bgBlue = vandq_u16(bg, vdupq_n_u16(0x1F));
+  uint16x8_t r = divideAlphaMaxNEON(vmlaq_u16(red, bgRed, bgAlpha));
+  uint16x8_t g = divideAlphaMaxNEON(vmlaq_u16(green, bgGreen, bgAlpha));
+  uint16x8_t b = divideAlphaMaxNEON(vmlaq_u16(blue, bgBlue, bgAlpha));
+  return vorrq_u16(vorrq_u16(vshlq_n_u16(r, 11), vshlq_n_u16(g, 5)), b);
+}
+
+static inline uint16x8_t blendRGB565_NEON(uint16x8_t bg, uint16x8_t alpha, uint16x8_t red, uint16x8_t green, uint16x8_t blue)
+{
+  uint16x8_t bgAlpha = vsubq_u16(vdupq_n_u16(ALPHA_MAX), alpha);
+  return blendPremultipliedRGB565_NEON(bg, bgAlpha, vmulq_u16(red, alpha), vmulq_u16(green, alpha), vmulq_u16(blue, alpha));
+}
+
+static inline float32x4_t reciprocalNEON(float32x4_t value)
+{
+#if defined(__aarch64__)
+  return vdivq_f32(vdupq_n_f32(1.0f), value);
+#else
+  float32x4_t result = vrecpeq_f32(value);
+  result = vmulq_f32(vrecpsq_f32(value, result), result);
+  return vmulq_f32(vrecpsq_f32(value, result), result);
+#endif
+}
+
+static inline uint16x8_t divideNEON(uint16x8_t value, float32x4_t invLo, float32x4_t invHi)
+{
+  const float32x4_t bias = vdupq_n_f32(DIV_BIAS);
+  uint32x4_t lo = vcvtq_u32_f32(vmlaq_f32(bias, vcvtq_f32_u32(vmovl_u16(vget_low_u16(value))), invLo));
+  uint32x4_t hi = vcvtq_u32_f32(vmlaq_f32(bias, vcvtq_f32_u32(vmovl_u16(vget_high_u16(value))), invHi));
+  return vcombine_u16(vmovn_u32(lo), vmovn_u32(hi));
+}
+
+static inline uint16x8_t blendARGB4444_NEON(uint16x8_t bg, uint16x8_t alpha, uint16x8_t red, uint16x8_t green, uint16x8_t blue)
+{
+  const uint16x8_t nibble = vdupq_n_u16(0x0F);
+  uint16x8_t bgAlpha = vshrq_n_u16(bg, 12);
+  uint16x8_t bgRed = vandq_u16(vshrq_n_u16(bg, 8), nibble);
+  uint16x8_t bgGreen = vandq_u16(vshrq_n_u16(bg, 4), nibble);
+  uint16x8_t bgBlue = vandq_u16(bg, nibble);
+  uint16x8_t a = vaddq_u16(alpha, divideAlphaMaxNEON(vmulq_u16(bgAlpha, vsubq_u16(nibble, alpha))));
+  float32x4_t invLo = reciprocalNEON(vcvtq_f32_u32(vmovl_u16(vget_low_u16(a))));
+  float32x4_t invHi = reciprocalNEON(vcvtq_f32_u32(vmovl_u16(vget_high_u16(a))));
+  uint16x8_t r = vminq_u16(nibble, divideNEON(vmlaq_u16(vmulq_u16(red, alpha), bgRed, bgAlpha), invLo, invHi));
+  uint16x8_t g = vminq_u16(nibble, divideNEON(vmlaq_u16(vmulq_u16(green, alpha), bgGreen, bgAlpha), invLo, invHi));
+  uint16x8_t b = vminq_u16(nibble, divideNEON(vmlaq_u16(vmulq_u16(blue, alpha), bgBlue, bgAlpha), invLo, invHi));
+  uint16x8_t result = vbslq_u16(vceqq_u16(alpha, nibble), joinARGB4444_NEON(nibble, red, green, blue), joinARGB4444_NEON(a, r, g, b));
+  return vbslq_u16(vceqq_u16(alpha, vdupq_n_u16(0)), bg, result);
+}
+#endif
+
+void blitFillSpan(uint16_t * dest, int count, uint16_t value)
+{
+#if defined(BLIT_KERNELS_AVX2)
+  __m256i value256 = _mm256_set1_epi16(value);
+  for (; count >= 16; count -= 16, dest += 16) {
+    _mm256_storeu_si256((__m256i *)dest, value256);
+  }
+#endif
+
+#if defined(BLIT_KERNELS_SSE2)
+  __m128i value128 = _mm_set1_epi16(value);
+  for (; count >= 8; count -= 8, dest += 8) {
+    _mm_storeu_si128((__m128i *)dest, value128);
+  }
+#elif defined(BLIT_KERNELS_NEON)
+  uint16x8_t value128 = vdupq_n_u16(value);
+  for (; count >= 8; count -= 8, dest += 8) {
+    vst1q_u16(dest, value128);
+  }
+#endif
+
+  while (count-- > 0) {
+    *dest++ = value;
+  }
+}
+
+void blitCopySpan(uint16_t * dest, const uint16_t * src, int count)
+{
+  if (count > 0) {
+    memcpy(dest, src, count * sizeof(uint16_t));
+  }
+}
+
+static void convertRGB565ToARGB4444Span(uint16_t * dest, const uint16_t * src, int count)
+{
+#if defined(BLIT_KERNELS_SSE2)
+  const __m128i nibble = _mm_set1_epi16(0x0F);
+  const __m128i opaque = _mm_set1_epi16((short)0xF000);
+  for (; count >= 8; count -= 8, dest += 8, src += 8) {
+    __m128i q = _mm_loadu_si128((const __m128i *)src);
+    __m128i r = _mm_slli_epi16(_mm_srli_epi16(q, 12), 8);
+    __m128i g = _mm_slli_epi16(_mm_and_si128(_mm_srli_epi16(q, 7), nibble), 4);
+    __m128i b = _mm_and_si128(_mm_srli_epi16(q, 1), nibble);
+    _mm_storeu_si128((__m128i *)dest, _mm_or_si128(_mm_or_si128(opaque, r), _mm_or_si128(g, b)));
+  }
+#elif defined(BLIT_KERNELS_NEON)
+  const uint16x8_t nibble = vdupq_n_u16(0x0F);
+  const uint16x8_t opaque = vdupq_n_u16(0xF000);
+  for (; count >= 8; count -= 8, dest += 8, src += 8) {
+    uint16x8_t q = vld1q_u16(src);
+    uint16x8_t r = vshlq_n_u16(vshrq_n_u16(q, 12), 8);
+    uint16x8_t g = vshlq_n_u16(vandq_u16(vshrq_n_u16(q, 7), nibble), 4);
+    uint16x8_t b = vandq_u16(vshrq_n_u16(q, 1), nibble);
+    vst1q_u16(dest, vorrq_u16(vorrq_u16(opaque, r), vorrq_u16(g, b)));
+  }
+#endif
+
+  while (count-- > 0) {
+    *dest++ = opaqueARGB4444(*src++);
+  }
+}
+
+void blitAlphaBitmapSpan(uint16_t * dest, bool destAlpha, const uint16_t * src, bool srcAlpha, int count)
+{
+  if (!srcAlpha) {
+    if (destAlpha)
+      convertRGB565ToARGB4444Span(dest, src, count);
+    else
+      blitCopySpan(dest, src, count);
+    return;
+  }
+
+  if (destAlpha) {
+#if defined(BLIT_KERNELS_SSE2)
+    const __m128i nibble = _mm_set1_epi16(0x0F);
+    for (; count >= 8; count -= 8, dest += 8, src += 8) {
+      __m128i q = _mm_loadu_si128((const __m128i *)src);
+      __m128i alpha = _mm_srli_epi16(q, 12);
+      __m128i red = _mm_and_si128(_mm_srli_epi16(q, 8), nibble);
+      __m128i green = _mm_and_si128(_mm_srli_epi16(q, 4), nibble);
+      __m128i blue = _mm_and_si128(q, nibble);
+      __m128i p = _mm_loadu_si128((const __m128i *)dest);
+      _mm_storeu_si128((__m128i *)dest, blendARGB4444_SSE2(p, alpha, red, green, blue));
+    }
+#elif defined(BLIT_KERNELS_NEON)
+    const uint16x8_t nibble = vdupq_n_u16(0x0F);
+    for (; count >= 8; count -= 8, dest += 8, src += 8) {
+      uint16x8_t q = vld1q_u16(src);
+      uint16x8_t alpha = vshrq_n_u16(q, 12);
+      uint16x8_t red = vandq_u16(vshrq_n_u16(q, 8), nibble);
+      uint16x8_t green = vandq_u16(vshrq_n_u16(q, 4), nibble);
+      uint16x8_t blue = vandq_u16(q, nibble);
+      vst1q_u16(dest, blendARGB4444_NEON(vld1q_u16(dest), alpha, red, green, blue));
+    }
+#endif
+    for (; count > 0; count--, dest++, src++) {
+      ARGB_SPLIT(*src, a, r, g, b);
+      *dest = blendARGB4444(*dest, a, r, g, b);
+    }
+  }
+  else {
+#if defined(BLIT_KERNELS_AVX2)
+    const __m256i nibble256 = _mm256_set1_epi16(0x0F);
+    for (; count >= 16; count -= 16, dest += 16, src += 16) {
+      __m256i q = _mm256_loadu_si256((const __m256i *)src);
+      __m256i alpha = _mm256_srli_epi16(q, 12);
+      __m256i red = _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(q, 8), nibble256), 1);
+      __m256i green = _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(q, 4), nibble256), 2);
+      __m256i blue = _mm256_slli_epi16(_mm256_and_si256(q, nibble256), 1);
+      __m256i p = _mm256_loadu_si256((const __m256i *)dest);
+      _mm256_storeu_si256((__m256i *)dest, blendRGB565_AVX2(p, alpha, red, green, blue));
+    }
+#endif
+#if defined(BLIT_KERNELS_SSE2)
+    const __m128i nibble = _mm_set1_epi16(0x0F);
+    for (; count >= 8; count -= 8, dest += 8, src += 8) {
+      __m128i q = _mm_loadu_si128((const __m128i *)src);
+      __m128i alpha = _mm_srli_epi16(q, 12);
+      __m128i red = _mm_slli_epi16(_mm_and_si128(_mm_srli_epi16(q, 8), nibble), 1);
+      __m128i green = _mm_slli_epi16(_mm_and_si128(_mm_srli_epi16(q, 4), nibble), 2);
+      __m128i blue = _mm_slli_epi16(_mm_and_si128(q, nibble), 1);
+      __m128i p = _mm_loadu_si128((const __m128i *)dest);
+      _mm_storeu_si128((__m128i *)dest, blendRGB565_SSE2(p, alpha, red, green, blue));
+    }
+#elif defined(BLIT_KERNELS_NEON)
+    const uint16x8_t nibble = vdupq_n_u16(0x0F);
+    for (; count >= 8; count -= 8, dest += 8, src += 8) {
+      uint16x8_t q = vld1q_u16(src);
+      uint16x8_t alpha = vshrq_n_u16(q, 12);
+      uint16x8_t red = vshlq_n_u16(vandq_u16(vshrq_n_u16(q, 8), nibble), 1);
+      uint16x8_t green = vshlq_n_u16(vandq_u16(vshrq_n_u16(q, 4), nibble), 2);
+      uint16x8_t blue = vshlq_n_u16(vandq_u16(q, nibble), 1);
+      vst1q_u16(dest, blendRGB565_NEON(vld1q_u16(dest), alpha, red, green, blue));
+    }
+#endif
+    for (; count > 0; count--, dest++, src++) {
+      ARGB_SPLIT(*src, a, r, g, b);
+      *dest = blendRGB565(*dest, a, r << 1, g << 2, b << 1);
+    }
+  }
+}
+
+void blitAlphaMaskSpan(uint16_t * dest, bool destAlpha, const uint8_t * mask, int count, uint16_t color)
+{
+  RGB_SPLIT(color, red, green, blue);
+
+  if (destAlpha) {
+    red >>= 1;
+    green >>= 2;
+    blue >>= 1;
+#if defined(BLIT_KERNELS_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i red128 = _mm_set1_epi16(red);
+    const __m128i green128 = _mm_set1_epi16(green);
+    const __m128i blue128 = _mm_set1_epi16(blue);
+    for (; count >= 8; count -= 8, dest += 8, mask += 8) {
+      __m128i alpha = _mm_srli_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)mask), zero), 4);
+      __m128i p = _mm_loadu_si128((const __m128i *)dest);
+      _mm_storeu_si128((__m128i *)dest, blendARGB4444_SSE2(p, alpha, red128, green128, blue128));
+    }
+#elif defined(BLIT_KERNELS_NEON)
+    const uint16x8_t red128 = vdupq_n_u16(red);
+    const uint16x8_t green128 = vdupq_n_u16(green);
+    const uint16x8_t blue128 = vdupq_n_u16(blue);
+    for (; count >= 8; count -= 8, dest += 8, mask += 8) {
+      uint16x8_t alpha = vshrq_n_u16(vmovl_u8(vld1_u8(mask)), 4);
+      vst1q_u16(dest, blendARGB4444_NEON(vld1q_u16(dest), alpha, red128, green128, blue128));
+    }
+#endif
+    for (; count > 0; count--, dest++, mask++) {
+      *dest = blendARGB4444(*dest, *mask >> 4, red, green, blue);
+    }
+  }
+  else {
+#if defined(BLIT_KERNELS_AVX2)
+    const __m256i red256 = _mm256_set1_epi16(red);
+    const __m256i green256 = _mm256_set1_epi16(green);
+    const __m256i blue256 = _mm256_set1_epi16(blue);
+    for (; count >= 16; count -= 16, dest += 16, mask += 16) {
+      __m256i alpha = _mm256_srli_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)mask)), 4);
+      __m256i p = _mm256_loadu_si256((const __m256i *)dest);
+      _mm256_storeu_si256((__m256i *)dest, blendRGB565_AVX2(p, alpha, red256, green256, blue256));
+    }
+#endif
+#if defined(BLIT_KERNELS_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i red128 = _mm_set1_epi16(red);
+    const __m128i green128 = _mm_set1_epi16(green);
+    const __m128i blue128 = _mm_set1_epi16(blue);
+    for (; count >= 8; count -= 8, dest += 8, mask += 8) {
+      __m128i alpha = _mm_srli_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)mask), zero), 4);
+      __m128i p = _mm_loadu_si128((const __m128i *)dest);
+      _mm_storeu_si128((__m128i *)dest, blendRGB565_SSE2(p, alpha, red128, green128, blue128));
+    }
+#elif defined(BLIT_KERNELS_NEON)
+    const uint16x8_t red128 = vdupq_n_u16(red);
+    const uint16x8_t green128 = vdupq_n_u16(green);
+    const uint16x8_t blue128 = vdupq_n_u16(blue);
+    for (; count >= 8; count -= 8, dest += 8, mask += 8) {
+      uint16x8_t alpha = vshrq_n_u16(vmovl_u8(vld1_u8(mask)), 4);
+      vst1q_u16(dest, blendRGB565_NEON(vld1q_u16(dest), alpha, red128, green128, blue128));
+    }
+#endif
+    for (; count > 0; count--, dest++, mask++) {
+      *dest = blendRGB565(*dest, *mask >> 4, red, green, blue);
+    }
+  }
+}
+
+// Unpacks count 4 bits mask values, the nibble n becoming n * 0x11
+static void unpackMask4(uint8_t * dest, const uint8_t * src, int first, int count)
+{
+  if (count > 0 && first) {
+    *dest++ = (*src++ >> 4) * 0x11;
+    count--;
+  }
+
+#if defined(BLIT_KERNELS_SSE2)
+  const __m128i nibble = _mm_set1_epi8(0x0F);
+  for (; count >= 16; count -= 16, dest += 16, src += 8) {
+    __m128i q = _mm_loadl_epi64((const __m128i *)src);
+    __m128i values = _mm_unpacklo_epi8(_mm_and_si128(q, nibble), _mm_and_si128(_mm_srli_epi16(q, 4), nibble));
+    _mm_storeu_si128((__m128i *)dest, _mm_or_si128(values, _mm_slli_epi16(values, 4)));
+  }
+#elif defined(BLIT_KERNELS_NEON)
+  for (; count >= 16; count -= 16, dest += 16, src += 8) {
+    uint8x8_t q = vld1_u8(src);
+    uint8x8x2_t values = vzip_u8(vand_u8(q, vdup_n_u8(0x0F)), vshr_n_u8(q, 4));
+    vst1_u8(dest, vorr_u8(values.val[0], vshl_n_u8(values.val[0], 4)));
+    vst1_u8(dest + 8, vorr_u8(values.val[1], vshl_n_u8(values.val[1], 4)));
+  }
+#endif
+
+  for (; count >= 2; count -= 2, dest += 2, src++) {
+    dest[0] = (*src & 0x0F) * 0x11;
+    dest[1] = (*src >> 4) * 0x11;
+  }
+
+  if (count > 0) {
+    *dest = (*src & 0x0F) * 0x11;
+  }
+}
+
+void blitAlphaMask4Span(uint16_t * dest, bool destAlpha, const uint8_t * mask, int first, int count, uint16_t color)
+{
+  uint8_t values[64];
+  while (count > 0) {
+    int n = min<int>(count, sizeof(values));
+    unpackMask4(values, mask, first, n);
+    blitAlphaMaskSpan(dest, destAlpha, values, n, color);
+    dest += n;
+    count -= n;
+    mask += (first + n) / 2;
+    first = (first + n) & 1;
+  }
+}
+
+void blitBlendSpan(uint16_t * dest, bool destAlpha, int count, uint8_t alpha, uint16_t color)
+{
+  if (alpha == 0) {
+    return;
+  }
+
+  if (alpha >= ALPHA_MAX) {
+    blitFillSpan(dest, count, destAlpha ? opaqueARGB4444(color) : color);
+    return;
+  }
+
+  if (destAlpha) {
+    ColorBlender<true> blender(alpha, color);
+#if defined(BLIT_KERNELS_SSE2)
+    const __m128i alpha128 = _mm_set1_epi16(alpha);
+    const __m128i red128 = _mm_set1_epi16(blender.red / alpha);
+    const __m128i green128 = _mm_set1_epi16(blender.green / alpha);
+    const __m128i blue128 = _mm_set1_epi16(blender.blue / alpha);
+    for (; count >= 8; count -= 8, dest += 8) {
+      __m128i p = _mm_loadu_si128((const __m128i *)dest);
+      _mm_storeu_si128((__m128i *)dest, blendARGB4444_SSE2(p, alpha128, red128, green128, blue128));
+    }
+#elif defined(BLIT_KERNELS_NEON)
+    const uint16x8_t alpha128 = vdupq_n_u16(alpha);
+    const uint16x8_t red128 = vdupq_n_u16(blender.red / alpha);
+    const uint16x8_t green128 = vdupq_n_u16(blender.green / alpha);
+    const uint16x8_t blue128 = vdupq_n_u16(blender.blue / alpha);
+    for (; count >= 8; count -= 8, dest += 8) {
+      vst1q_u16(dest, blendARGB4444_NEON(vld1q_u16(dest), alpha128, red128, green128, blue128));
+    }
+#endif
+    for (; count > 0; count--, dest++) {
+      *dest = blender.blend(*dest);
+    }
+  }
+  else {
+    ColorBlender<false> blender(alpha, color);
+#if defined(BLIT_KERNELS_AVX2)
+    const __m256i bgAlpha256 = _mm256_set1_epi16(ALPHA_MAX - alpha);
+    const __m256i red256 = _mm256_set1_epi16(blender.red);
+    const __m256i green256 = _mm256_set1_epi16(blender.green);
+    const __m256i blue256 = _mm256_set1_epi16(blender.blue);
+    for (; count >= 16; count -= 16, dest += 16) {
+      __m256i p = _mm256_loadu_si256((const __m256i *)dest);
+      _mm256_storeu_si256((__m256i *)dest, blendPremultipliedRGB565_AVX2(p, bgAlpha256, red256, green256, blue256));
+    }
+#endif
+#if defined(BLIT_KERNELS_SSE2)
+    const __m128i bgAlpha128 = _mm_set1_epi16(ALPHA_MAX - alpha);
+    const __m128i red128 = _mm_set1_epi16(blender.red);
+    const __m128i green128 = _mm_set1_epi16(blender.green);
+    const __m128i blue128 = _mm_set1_epi16(blender.blue);
+    for (; count >= 8; count -= 8, dest += 8) {
+      __m128i p = _mm_loadu_si128((const __m128i *)dest);
+      _mm_storeu_si128((__m128i *)dest, blendPremultipliedRGB565_SSE2(p, bgAlpha128, red128, green128, blue128));
+    }
+#elif defined(BLIT_KERNELS_NEON)
+    const uint16x8_t bgAlpha128 = vdupq_n_u16(ALPHA_MAX - alpha);
+    const uint16x8_t red128 = vdupq_n_u16(blender.red);
+    const uint16x8_t green128 = vdupq_n_u16(blender.green);
+    const uint16x8_t blue128 = vdupq_n_u16(blender.blue);
+    for (; count >= 8; count -= 8, dest += 8) {
+      vst1q_u16(dest, blendPremultipliedRGB565_NEON(vld1q_u16(dest), bgAlpha128, red128, green128, blue128));
+    }
+#endif
+    for (; count > 0; count--, dest++) {
+      *dest = blender.blend(*dest);
+    }
+  }
+}
+
+template <bool DEST_ALPHA>
+static void blendColumn(uint16_t * dest, int stride, int count, uint8_t alpha, uint16_t color)
+{
+  ColorBlender<DEST_ALPHA> blender(alpha, color);
+  for (; count > 0; count--, dest += stride) {
+    *dest = blender.blend(*dest);
+  }
+}
+
+void blitBlendColumn(uint16_t * dest, int stride, bool destAlpha, int count, uint8_t alpha, uint16_t color)
+{
+  if (alpha == 0) {
+    return;
+  }
+
+  if (alpha >= ALPHA_MAX) {
+    uint16_t value = destAlpha ? opaqueARGB4444(color) : color;
+    for (; count > 0; count--, dest += stride) {
+      *dest = value;
+    }
+    return;
+  }
+
+  if (destAlpha)
+    blendColumn<true>(dest, stride, count, alpha, color);
+  else
+    blendColumn<false>(dest, stride, count, alpha, color);
+}
+
+void blitPaletteSpan(uint16_t * dest, const uint8_t * src, const uint16_t * palette, int count)
+{
+  // a 256 values table is out of reach of the byte shuffles
+  for (; count >= 4; count -= 4, dest += 4, src += 4) {
+    dest[0] = palette[src[0]];
+    dest[1] = palette[src[1]];
+    dest[2] = palette[src[2]];
+    dest[3] = palette[src[3]];
+  }
+
+  while (count-- > 0) {
+    *dest++ = palette[*src++];
+  }
+}
+
+void blitPalette4Span(uint16_t * dest, const uint8_t * src, int first, const uint16_t * palette, int count)
+{
+  if (count > 0 && first) {
+    *dest++ = palette[*src++ >> 4];
+    count--;
+  }
+
+#if defined(BLIT_KERNELS_SSSE3) || (defined(BLIT_KERNELS_NEON) && defined(__aarch64__))
+  // the low and high bytes of the palette values are 2 tables of 16 bytes,
+  // which the byte shuffles look up 16 pixels at once
+  uint8_t lowBytes[16];
+  uint8_t highBytes[16];
+  for (int i = 0; i < 16; i++) {
+    lowBytes[i] = palette[i];
+    highBytes[i] = palette[i] >> 8;
+  }
+#endif
+
+#if defined(BLIT_KERNELS_SSSE3)
+  const __m128i nibble = _mm_set1_epi8(0x0F);
+  const __m128i low128 = _mm_loadu_si128((const __m128i *)lowBytes);
+  const __m128i high128 = _mm_loadu_si128((const __m128i *)highBytes);
+  for (; count >= 16; count -= 16, dest += 16, src += 8) {
+    __m128i q = _mm_loadl_epi64((const __m128i *)src);
+    __m128i indexes = _mm_unpacklo_epi8(_mm_and_si128(q, nibble), _mm_and_si128(_mm_srli_epi16(q, 4), nibble));
+    __m128i low = _mm_shuffle_epi8(low128, indexes);
+    __m128i high = _mm_shuffle_epi8(high128, indexes);
+    _mm_storeu_si128((__m128i *)dest, _mm_unpacklo_epi8(low, high));
+    _mm_storeu_si128((__m128i *)(dest + 8), _mm_unpackhi_epi8(low, high));
+  }
+#elif defined(BLIT_KERNELS_NEON) && defined(__aarch64__)
+  const uint8x16_t low128 = vld1q_u8(lowBytes);
+  const uint8x16_t high128 = vld1q_u8(highBytes);
+  for (; count >= 16; count -= 16, dest += 16, src += 8) {
+    uint8x8_t q = vld1_u8(src);
+    uint8x8x2_t nibbles = vzip_u8(vand_u8(q, vdup_n_u8(0x0F)), vshr_n_u8(q, 4));
+    uint8x16_t indexes = vcombine_u8(nibbles.val[0], nibbles.val[1]);
+    uint8x16x2_t values = vzipq_u8(vqtbl1q_u8(low128, indexes), vqtbl1q_u8(high128, indexes));
+    vst1q_u8((uint8_t *)dest, values.val[0]);
+    vst1q_u8((uint8_t *)(dest + 8), values.val[1]);
+  }
+#endif
+
+  for (; count >= 2; count -= 2, dest += 2, src++) {
+    dest[0] = palette[*src & 0x0F];
+    dest[1] = palette[*src >> 4];
+  }
+
+  if (count > 0) {
+    *dest = palette[*src & 0x0F];
+  }
+}
+
+// The pixels are read 8 at a time before being written, so that the 16 bits
+// pixels never overwrite source bytes not read yet when dest is src
+
+void blitRGBA8888ToRGB565Span(uint16_t * dest, const uint8_t * src, int count)
+{
+#if defined(BLIT_KERNELS_SSE2)
+  const __m128i red = _mm_set1_epi32(0xF8);
+  const __m128i green = _mm_set1_epi32(0xFC00);
+  const __m128i blue = _mm_set1_epi32(0xF80000);
+  for (; count >= 8; count -= 8, dest += 8, src += 32) {
+    __m128i lo = _mm_loadu_si128((const __m128i *)src);
+    __m128i hi = _mm_loadu_si128((const __m128i *)(src + 16));
+    lo = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(_mm_and_si128(lo, red), 8), _mm_srli_epi32(_mm_and_si128(lo, green), 5)), _mm_srli_epi32(_mm_and_si128(lo, blue), 19));
+    hi = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(_mm_and_si128(hi, red), 8), _mm_srli_epi32(_mm_and_si128(hi, green), 5)), _mm_srli_epi32(_mm_and_si128(hi, blue), 19));
+    // sign extended, so that the signed saturation keeps the 16 bits values
+    lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+    hi = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+    _mm_storeu_si128((__m128i *)dest, _mm_packs_epi32(lo, hi));
+  }
+#elif defined(BLIT_KERNELS_NEON)
+  for (; count >= 8; count -= 8, dest += 8, src += 32) {
+    uint8x8x4_t q = vld4_u8(src);
+    uint16x8_t value = vsriq_n_u16(vshll_n_u8(q.val[0], 8), vshll_n_u8(q.val[1], 8), 5);
+    vst1q_u16(dest, vsriq_n_u16(value, vshll_n_u8(q.val[2], 8), 11));
+  }
+#endif
+
+  for (; count > 0; count--, src += 4) {
+    *dest++ = RGB565(src[0], src[1], src[2]);
+  }
+}
+
+void blitRGBA8888ToARGB4444Span(uint16_t * dest, const uint8_t * src, int count)
+{
+#if defined(BLIT_KERNELS_SSE2)
+  const __m128i nibble = _mm_set1_epi32(0x0F);
+  const __m128i high = _mm_set1_epi32(0xF0);
+  const __m128i alpha = _mm_set1_epi32(0xF000);
+  for (; count >= 8; count -= 8, dest += 8, src += 32) {
+    __m128i lo = _mm_loadu_si128((const __m128i *)src);
+    __m128i hi = _mm_loadu_si128((const __m128i *)(src + 16));
+    lo = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_srli_epi32(lo, 16), alpha), _mm_slli_epi32(_mm_and_si128(lo, high), 4)),
+                      _mm_or_si128(_mm_and_si128(_mm_srli_epi32(lo, 8), high), _mm_and_si128(_mm_srli_epi32(lo, 20), nibble)));
+    hi = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_srli_epi32(hi, 16), alpha), _mm_slli_epi32(_mm_and_si128(hi, high), 4)),
+                      _mm_or_si128(_mm_and_si128(_mm_srli_epi32(hi, 8), high), _mm_and_si128(_mm_srli_epi32(hi, 20), nibble)));
+    lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+    hi = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+    _mm_storeu_si128((__m128i *)dest, _mm_packs_epi32(lo, hi));
+  }
+#elif defined(BLIT_KERNELS_NEON)
+  for (; count >= 8; count -= 8, dest += 8, src += 32) {
+    uint8x8x4_t q = vld4_u8(src);
+    uint16x8_t value = vsriq_n_u16(vshll_n_u8(q.val[3], 8), vshll_n_u8(q.val[0], 8), 4);
+    value = vsriq_n_u16(value, vshll_n_u8(q.val[1], 8), 8);
+    vst1q_u16(dest, vsriq_n_u16(value, vshll_n_u8(q.val[2], 8), 12));
+  }
+#endif
+
+  for (; count > 0; count--, src += 4) {
+    *dest++ = ARGB4444(src[3], src[0], src[1], src[2]);
+  }
+}
+
+void blitRGB888ToRGB565Span(uint16_t * dest, const uint8_t * src, int count)
+{
+#if defined(BLIT_KERNELS_SSSE3)
+  // the 24 bytes of 8 pixels are gathered by channel in 16 bits lanes
+  const __m128i redLo = _mm_setr_epi8(0, -1, 3, -1, 6, -1, 9, -1, 12, -1, 15, -1, -1, -1, -1, -1);
+  const __m128i redHi = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, -1, 5, -1);
+  const __m128i greenLo = _mm_setr_epi8(1, -1, 4, -1, 7, -1, 10, -1, 13, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i greenHi = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, -1, 3, -1, 6, -1);
+  const __m128i blueLo = _mm_setr_epi8(2, -1, 5, -1, 8, -1, 11, -1, 14, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i blueHi = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, -1, 4, -1, 7, -1);
+  for (; count >= 8; count -= 8, dest += 8, src += 24) {
+    __m128i lo = _mm_loadu_si128((const __m128i *)src);
+    __m128i hi = _mm_loadl_epi64((const __m128i *)(src + 16));
+    __m128i r = _mm_or_si128(_mm_shuffle_epi8(lo, redLo), _mm_shuffle_epi8(hi, redHi));
+    __m128i g = _mm_or_si128(_mm_shuffle_epi8(lo, greenLo), _mm_shuffle_epi8(hi, greenHi));
+    __m128i b = _mm_or_si128(_mm_shuffle_epi8(lo, blueLo), _mm_shuffle_epi8(hi, blueHi));
+    r = _mm_slli_epi16(_mm_srli_epi16(r, 3), 11);
+    g = _mm_slli_epi16(_mm_srli_epi16(g, 2), 5);
+    _mm_storeu_si128((__m128i *)dest, _mm_or_si128(_mm_or_si128(r, g), _mm_srli_epi16(b, 3)));
+  }
+#elif defined(BLIT_KERNELS_NEON)
+  for (; count >= 8; count -= 8, dest += 8, src += 24) {
+    uint8x8x3_t q = vld3_u8(src);
+    uint16x8_t value = vsriq_n_u16(vshll_n_u8(q.val[0], 8), vshll_n_u8(q.val[1], 8), 5);
+    vst1q_u16(dest, vsriq_n_u16(value, vshll_n_u8(q.val[2], 8), 11));
+  }
+#endif
+
+  for (; count > 0; count--, src += 3) {
+    *dest++ = RGB565(src[0], src[1], src[2]);
+  }
+}
+
+// Edge of the tiles used by the transposes: a tile of the source and one of
+// the destination both stay in the cache whatever the strides
+constexpr int BLIT_TILE = 8;
+
+template <class T>
+static void reverseSpan(T * dest, const T * src, int count)
+{
+  for (int i = 0; i < count; i++) {
+    dest[i] = src[count - 1 - i];
+  }
+}
+
+static void reverseSpan(uint16_t * dest, const uint16_t * src, int count)
+{
+  int i = 0;
+#if defined(BLIT_KERNELS_SSE2)
+  for (; i + 8 <= count; i += 8) {
+    __m128i value = _mm_loadu_si128((const __m128i *)(src + count - 8 - i));
+    value = _mm_shufflelo_epi16(value, 0x1B);
+    value = _mm_shufflehi_epi16(value, 0x1B);
+    _mm_storeu_si128((__m128i *)(dest + i), _mm_shuffle_epi32(value, 0x4E));
+  }
+#elif defined(BLIT_KERNELS_NEON)
+  for (; i + 8 <= count; i += 8) {
+    uint16x8_t value = vrev64q_u16(vld1q_u16(src + count - 8 - i));
+    vst1q_u16(dest + i, vcombine_u16(vget_high_u16(value), vget_low_u16(value)));
+  }
+#endif
+  for (; i < count; i++) {
+    dest[i] = src[count - 1 - i];
+  }
+}
+
+template <class T>
+static inline void transposeTile(T * dest, int destStride, const T * src, int srcStride, int rows, int cols)
+{
+  for (int c = 0; c < cols; c++) {
+    for (int r = 0; r < rows; r++) {
+      dest[c * destStride + r] = src[r * srcStride + c];
+    }
+  }
+}
+
+static inline void transposeTile(uint16_t * dest, int destStride, const uint16_t * src, int srcStride, int rows, int cols)
+{
+#if defined(BLIT_KERNELS_SSE2)
+  if (rows == 8 && cols == 8) {
+    __m128i r0 = _mm_loadu_si128((const __m128i *)(src + 0 * srcStride));
+    __m128i r1 = _mm_loadu_si128((const __m128i *)(src + 1 * srcStride));
+    __m128i r2 = _mm_loadu_si128((const __m128i *)(src + 2 * srcStride));
+    __m128i r3 = _mm_loadu_si128((const __m128i *)(src + 3 * srcStride));
+    __m128i r4 = _mm_loadu_si128((const __m128i *)(src + 4 * srcStride));
+    __m128i r5 = _mm_loadu_si128((const __m128i *)(src + 5 * srcStride));
+    __m128i r6 = _mm_loadu_si128((const __m128i *)(src + 6 * srcStride));
+    __m128i r7 = _mm_loadu_si128((const __m128i *)(src + 7 * srcStride));
+    __m128i t0 = _mm_unpacklo_epi16(r0, r1);
+    __m128i t1 = _mm_unpackhi_epi16(r0, r1);
+    __m128i t2 = _mm_unpacklo_epi16(r2, r3);
+    __m128i t3 = _mm_unpackhi_epi16(r2, r3);
+    __m128i t4 = _mm_unpacklo_epi16(r4, r5);
+    __m128i t5 = _mm_unpackhi_epi16(r4, r5);
+    __m128i t6 = _mm_unpacklo_epi16(r6, r7);
+    __m128i t7 = _mm_unpackhi_epi16(r6, r7);
+    __m128i u0 = _mm_unpacklo_epi32(t0, t2);
+    __m128i u1 = _mm_unpackhi_epi32(t0, t2);
+    __m128i u2 = _mm_unpacklo_epi32(t1, t3);
+    __m128i u3 = _mm_unpackhi_epi32(t1, t3);
+    __m128i u4 = _mm_unpacklo_epi32(t4, t6);
+    __m128i u5 = _mm_unpackhi_epi32(t4, t6);
+    __m128i u6 = _mm_unpacklo_epi32(t5, t7);
+    __m128i u7 = _mm_unpackhi_epi32(t5, t7);
+    _mm_storeu_si128((__m128i *)(dest + 0 * destStride), _mm_unpacklo_epi64(u0, u4));
+    _mm_storeu_si128((__m128i *)(dest + 1 * destStride), _mm_unpackhi_epi64(u0, u4));
+    _mm_storeu_si128((__m128i *)(dest + 2 * destStride), _mm_unpacklo_epi64(u1, u5));
+    _mm_storeu_si128((__m128i *)(dest + 3 * destStride), _mm_unpackhi_epi64(u1, u5));
+    _mm_storeu_si128((__m128i *)(dest + 4 * destStride), _mm_unpacklo_epi64(u2, u6));
+    _mm_storeu_si128((__m128i *)(dest + 5 * destStride), _mm_unpackhi_epi64(u2, u6));
+    _mm_storeu_si128((__m128i *)(dest + 6 * destStride), _mm_unpacklo_epi64(u3, u7));
+    _mm_storeu_si128((__m128i *)(dest + 7 * destStride), _mm_unpackhi_epi64(u3, u7));
+    return;
+  }
+#elif defined(BLIT_KERNELS_NEON)
+  if (rows == 8 && cols == 8) {
+    uint16x8x2_t a0 = vtrnq_u16(vld1q_u16(src + 0 * srcStride), vld1q_u16(src + 1 * srcStride));
+    uint16x8x2_t a1 = vtrnq_u16(vld1q_u16(src + 2 * srcStride), vld1q_u16(src + 3 * srcStride));
+    uint16x8x2_t a2 = vtrnq_u16(vld1q_u16(src + 4 * srcStride), vld1q_u16(src + 5 * srcStride));
+    uint16x8x2_t a3 = vtrnq_u16(vld1q_u16(src + 6 * srcStride), vld1q_u16(src + 7 * srcStride));
+    // columns 0 and 4, 2 and 6 of rows 0-3 then of rows 4-7
+    uint32x4x2_t b0 = vtrnq_u32(vreinterpretq_u32_u16(a0.val[0]), vreinterpretq_u32_u16(a1.val[0]));
+    uint32x4x2_t b2 = vtrnq_u32(vreinterpretq_u32_u16(a2.val[0]), vreinterpretq_u32_u16(a3.val[0]));
+    // columns 1 and 5, 3 and 7
+    uint32x4x2_t b1 = vtrnq_u32(vreinterpretq_u32_u16(a0.val[1]), vreinterpretq_u32_u16(a1.val[1]));
+    uint32x4x2_t b3 = vtrnq_u32(vreinterpretq_u32_u16(a2.val[1]), vreinterpretq_u32_u16(a3.val[1]));
+    uint16x8_t c0 = vreinterpretq_u16_u32(b0.val[0]), d0 = vreinterpretq_u16_u32(b2.val[0]);
+    uint16x8_t c2 = vreinterpretq_u16_u32(b0.val[1]), d2 = vreinterpretq_u16_u32(b2.val[1]);
+    uint16x8_t c1 = vreinterpretq_u16_u32(b1.val[0]), d1 = vreinterpretq_u16_u32(b3.val[0]);
+    uint16x8_t c3 = vreinterpretq_u16_u32(b1.val[1]), d3 = vreinterpretq_u16_u32(b3.val[1]);
+    vst1q_u16(dest + 0 * destStride, vcombine_u16(vget_low_u16(c0), vget_low_u16(d0)));
+    vst1q_u16(dest + 1 * destStride, vcombine_u16(vget_low_u16(c1), vget_low_u16(d1)));
+    vst1q_u16(dest + 2 * destStride, vcombine_u16(vget_low_u16(c2), vget_low_u16(d2)));
+    vst1q_u16(dest + 3 * destStride, vcombine_u16(vget_low_u16(c3), vget_low_u16(d3)));
+    vst1q_u16(dest + 4 * destStride, vcombine_u16(vget_high_u16(c0), vget_high_u16(d0)));
+    vst1q_u16(dest + 5 * destStride, vcombine_u16(vget_high_u16(c1), vget_high_u16(d1)));
+    vst1q_u16(dest + 6 * destStride, vcombine_u16(vget_high_u16(c2), vget_high_u16(d2)));
+    vst1q_u16(dest + 7 * destStride, vcombine_u16(vget_high_u16(c3), vget_high_u16(d3)));
+    return;
+  }
+#endif
+  transposeTile<uint16_t>(dest, destStride, src, srcStride, rows, cols);
+}
+
+// dest[c * destStride + r] = src[r * srcStride + c], tile by tile
+template <class T>
+static void transpose(T * dest, int destStride, const T * src, int srcStride, int rows, int cols)
+{
+  for (int r = 0; r < rows; r += BLIT_TILE) {
+    int tileRows = min<int>(BLIT_TILE, rows - r);
+    for (int c = 0; c < cols; c += BLIT_TILE) {
+      int tileCols = min<int>(BLIT_TILE, cols - c);
+      transposeTile(dest + c * destStride + r, destStride, src + r * srcStride + c, srcStride, tileRows, tileCols);
+    }
+  }
+}
+
+template <class T>
+static void copyBlock(T * dest, int destXStep, int destYStep, const T * src, int srcXStep, int srcYStep, int w, int h)
+{
+  if (w <= 0 || h <= 0) {
+    return;
+  }
+
+  // the inner loop walks along the contiguous axis of the destination
+  if (destXStep != 1 && destXStep != -1) {
+    std::swap(destXStep, destYStep);
+    std::swap(srcXStep, srcYStep);
+    std::swap(w, h);
+  }
+
+  if (destXStep == -1) {
+    dest -= w - 1;
+    src += (w - 1) * srcXStep;
+    destXStep = 1;
+    srcXStep = -srcXStep;
+  }
+
+  if (srcXStep == 1) {
+    for (int y = 0; y < h; y++) {
+      memcpy(dest + y * destYStep, src + y * srcYStep, w * sizeof(T));
+    }
+  }
+  else if (srcXStep == -1) {
+    for (int y = 0; y < h; y++) {
+      reverseSpan(dest + y * destYStep, src + y * srcYStep - (w - 1), w);
+    }
+  }
+  else if (srcYStep == 1 || srcYStep == -1) {
+    if (srcYStep == -1) {
+      dest += (h - 1) * destYStep;
+      src -= h - 1;
+      destYStep = -destYStep;
+    }
+    transpose(dest, destYStep, src, srcXStep, w, h);
+  }
+  else {
+    for (int y = 0; y < h; y++) {
+      for (int x = 0; x < w; x++) {
+        dest[y * destYStep + x] = src[y * srcYStep + x * srcXStep];
+      }
+    }
+  }
+}
+
+void blitCopyBlock(uint16_t * dest, int destXStep, int destYStep, const uint16_t * src, int srcXStep, int srcYStep, int w, int h)
+{
+  copyBlock(dest, destXStep, destYStep, src, srcXStep, srcYStep, w, h);
+}
+
+void blitCopyBlock(uint8_t * dest, int destXStep, int destYStep, const uint8_t * src, int srcXStep, int srcYStep, int w, int h)
+{
+  copyBlock(dest, destXStep, destYStep, src, srcXStep, srcYStep, w, h);
+}
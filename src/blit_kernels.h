@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) OpenTX
+ *
+ * Source:
+ *  https://github.com/opentx/libopenui
+ *
+ * This file is a part of libopenui library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#pragma once
+
+#include <cinttypes>
+
+// Software pixel kernels, working on one contiguous span of pixels.
+// The SIMD flavour (AVX2, SSE2, NEON or scalar) is chosen at build time,
+// define BLIT_KERNELS_SCALAR to force the scalar one.
+//
+// Blending follows BitmapBuffer::drawAlphaPixel(): alpha is 0..ALPHA_MAX,
+// RGB565 destinations are blended, ARGB4444 destinations are composited.
+
+void blitFillSpan(uint16_t * dest, int count, uint16_t value);
+
+void blitCopySpan(uint16_t * dest, const uint16_t * src, int count);
+
+void blitAlphaBitmapSpan(uint16_t * dest, bool destAlpha, const uint16_t * src, bool srcAlpha, int count);
+
+void blitAlphaMaskSpan(uint16_t * dest, bool destAlpha, const uint8_t * mask, int count, uint16_t color);
+
+// Same with a mask of 4 bits per pixel, the low nibble of a byte being the
+// first pixel. The mask starts at the nibble first (0 or 1) of mask
+void blitAlphaMask4Span(uint16_t * dest, bool destAlpha, const uint8_t * mask, int first, int count, uint16_t color);
+
+// Blends count pixels with the same RGB565 color at the same alpha
+void blitBlendSpan(uint16_t * dest, bool destAlpha, int count, uint8_t alpha, uint16_t color);
+
+// Same as blitBlendSpan() for pixels which are stride pixels apart
+void blitBlendColumn(uint16_t * dest, int stride, bool destAlpha, int count, uint8_t alpha, uint16_t color);
+
+// Expands count palette indexes to their palette values
+void blitPaletteSpan(uint16_t * dest, const uint8_t * src, const uint16_t * palette, int count);
+
+// Same with 4 bits indexes, the low nibble of a byte being the first pixel.
+// The indexes start at the nibble first (0 or 1) of src, the palette has 16
+// values
+void blitPalette4Span(uint16_t * dest, const uint8_t * src, int first, const uint16_t * palette, int count);
+
+// Converts count pixels of stb_image (RGBA 8888 or RGB 888 bytes). dest may
+// be src, the pixels are then converted in place
+void blitRGBA8888ToRGB565Span(uint16_t * dest, const uint8_t * src, int count);
+
+void blitRGBA8888ToARGB4444Span(uint16_t * dest, const uint8_t * src, int count);
+
+void blitRGB888ToRGB565Span(uint16_t * dest, const uint8_t * src, int count);
+
+// Copies a w x h block between two bitmap layouts: the pixel (x, y) is at
+// x * xStep + y * yStep from dest and src, where the steps may be negative.
+// Flips, 90° rotations and orientation changes go through tiled transposes
+void blitCopyBlock(uint16_t * dest, int destXStep, int destYStep, const uint16_t * src, int srcXStep, int srcYStep, int w, int h);
+
+void blitCopyBlock(uint8_t * dest, int destXStep, int destYStep, const uint8_t * src, int srcXStep, int srcYStep, int w, int h);
@@ -57,6 +57,11 @@ class FileReaderBase
       return fileSize;
     }
 
+    bool seek(size_t offset)
+    {
+      return file && f_lseek(file, offset) == FR_OK;
+    }
+
     size_t read(uint8_t * data, size_t size)
     {
       UINT count;
@@ -102,22 +107,37 @@ class FileBufferedReader: public FileReaderBase
     FileBufferedReader(const char * path, size_t bufferSize = 4096):
       FileReaderBase(path)
     {
-      open(path, bufferSize);
+      if (file) {
+        allocate(bufferSize);
+      }
     }
 
     bool open(const char * path, size_t bufferSize = 4096)
     {
       bool result = FileReaderBase::open(path);
       if (result) {
-        dataSize = bufferSize;
-        data = (uint8_t *)malloc(bufferSize);
-        dataRemaining = fileSize;
-        ptr = data;
-        dataAvailable = 0;
+        allocate(bufferSize);
       }
       return result;
     }
 
+    // Restarts the reading from the start of the file
+    bool rewind()
+    {
+      if (!seek(0)) {
+        return false;
+      }
+      dataRemaining = fileSize;
+      ptr = data;
+      dataAvailable = 0;
+      return true;
+    }
+
+    bool eof() const
+    {
+      return dataAvailable == 0 && dataRemaining == 0;
+    }
+
     ~FileBufferedReader()
     {
       free(data);
@@ -125,9 +145,15 @@ class FileBufferedReader: public FileReaderBase
 
     bool skip(size_t size)
     {
-      size_t read;
-      FileBufferedReader::read(size, &read);
-      return read == size;
+      while (size > 0) {
+        size_t read;
+        FileBufferedReader::read(size, &read);
+        if (read == 0) {
+          return false;
+        }
+        size -= read;
+      }
+      return true;
     }
 
     const uint8_t * read(size_t size, size_t * read)
@@ -168,6 +194,17 @@ class FileBufferedReader: public FileReaderBase
     uint8_t * data = nullptr;
     size_t dataSize = 0;
     uint8_t * ptr = nullptr;
+
+    void allocate(size_t bufferSize)
+    {
+      free(data);
+      data = (uint8_t *)malloc(bufferSize);
+      dataSize = data ? bufferSize : 0;
+      dataRemaining = data ? fileSize : 0;
+      ptr = data;
+      dataAvailable = 0;
+    }
+
     size_t dataAvailable = 0;
     size_t dataRemaining = 0;
 };
@@ -23,6 +23,9 @@
 #include "libopenui_config.h"
 #include "bitmapdata.h"
 
+class GlyphPageCache;
+class GlyphAtlas;
+
 constexpr uint8_t CJK_BYTE1_MIN = 0xFD;
 
 inline bool hasChineseChars(const char * str)
@@ -56,6 +59,7 @@ class Font
       const Font * font;
       unsigned offset;
       uint8_t width;
+      uint16_t index;
     };
 
     Font(const char * name, uint16_t count, const BitmapData * data, const uint16_t * specs):
@@ -66,6 +70,28 @@ class Font
     {
     }
 
+    // The glyphs masks have 4 bits per pixel, half the size of the 8 bits ones
+    Font(const char * name, uint16_t count, const PackedBitmapData * packedData, const uint16_t * specs):
+      name(name),
+      count(count),
+      packedData(packedData),
+      specs(specs)
+    {
+    }
+
+    // The glyphs are loaded from a file on first use (see GlyphPageCache)
+    Font(const char * name, uint16_t count, GlyphPageCache * pages, const uint16_t * specs):
+      name(name),
+      count(count),
+      pages(pages),
+      specs(specs)
+    {
+    }
+
+    // The glyphs are rasterized from a TrueType face on first use (see
+    // GlyphAtlas)
+    Font(const char * name, GlyphAtlas * atlas);
+
     coord_t getHeight() const
     {
       return specs[0];
@@ -80,7 +106,7 @@ class Font
     {
       // TODO check index not over table
       auto offset = specs[index + 1];
-      return {this, offset, uint8_t(specs[index + 2] - offset)};
+      return {this, offset, uint8_t(specs[index + 2] - offset), uint16_t(index)};
     }
 
     Glyph getChar(uint8_t c) const
@@ -89,7 +115,7 @@ class Font
         return getGlyph(c - 0x20);
       }
       else {
-        return {this, 0, 0};
+        return {this, 0, 0, 0};
       }
     }
 
@@ -138,6 +164,26 @@ class Font
       return data;
     }
 
+    [[nodiscard]] const PackedBitmapData * getPackedBitmapData() const
+    {
+      return packedData;
+    }
+
+    [[nodiscard]] bool isPacked() const
+    {
+      return packedData != nullptr;
+    }
+
+    [[nodiscard]] GlyphPageCache * getPages() const
+    {
+      return pages;
+    }
+
+    [[nodiscard]] GlyphAtlas * getAtlas() const
+    {
+      return atlas;
+    }
+
     [[nodiscard]] bool hasCJKChars() const
     {
       return count > CJK_FIRST_LETTER_INDEX;
@@ -146,7 +192,10 @@ class Font
   protected:
     const char * name;
     uint16_t count;
-    const BitmapData * data;
+    const BitmapData * data = nullptr;
+    const PackedBitmapData * packedData = nullptr;
+    GlyphPageCache * pages = nullptr;
+    GlyphAtlas * atlas = nullptr;
     const uint16_t * specs;
 };
 
@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) OpenTX
+ *
+ * Source:
+ *  https://github.com/opentx/libopenui
+ *
+ * This file is a part of libopenui library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+
+#include "glyphcache.h"
+
+GlyphPageCache::GlyphPageCache(const char * path, const uint16_t * specs, uint16_t count, uint8_t slotsCount):
+  file(path),
+  specs(specs),
+  count(count),
+  pagesCount((count + GLYPH_PAGE_SIZE - 1) / GLYPH_PAGE_SIZE),
+  slotsCount(min<uint8_t>(slotsCount, NO_SLOT - 1))
+{
+  coord_t maxPageWidth = 0;
+  for (unsigned page = 0; page < pagesCount; page++) {
+    maxPageWidth = max(maxPageWidth, getPageWidth(page));
+  }
+
+  // keep the slots 4 bytes aligned
+  slotSize = (sizeof(BitmapData) + maxPageWidth * specs[0] + 3) & ~3u;
+  buffer = (uint8_t *)malloc(this->slotsCount * slotSize);
+  slots = (Slot *)malloc(this->slotsCount * sizeof(Slot));
+  pageSlots = (uint8_t *)malloc(pagesCount);
+  if (!buffer || !slots || !pageSlots) {
+    TRACE("GlyphPageCache(%s) failed: not enough memory", path);
+    this->slotsCount = 0;
+    pagesCount = 0;
+    return;
+  }
+
+  for (uint8_t slot = 0; slot < this->slotsCount; slot++) {
+    slots[slot] = {NO_PAGE, 0};
+  }
+  memset(pageSlots, NO_SLOT, pagesCount);
+}
+
+GlyphPageCache::~GlyphPageCache()
+{
+  free(buffer);
+  free(slots);
+  free(pageSlots);
+}
+
+const BitmapData * GlyphPageCache::getPage(unsigned index, coord_t & x)
+{
+  unsigned page = index / GLYPH_PAGE_SIZE;
+  if (index >= count || page >= pagesCount) {
+    return nullptr;
+  }
+
+  x = specs[index + 1] - specs[page * GLYPH_PAGE_SIZE + 1];
+
+  if (++useCounter == 0) {
+    // the stamps only need to keep their order
+    for (uint8_t slot = 0; slot < slotsCount; slot++) {
+      slots[slot].lastUse = 0;
+    }
+    useCounter = 1;
+  }
+
+  auto slot = pageSlots[page];
+  if (slot != NO_SLOT) {
+    hits++;
+    slots[slot].lastUse = useCounter;
+    return getSlotData(slot);
+  }
+
+  misses++;
+
+  if (slotsCount == 0) {
+    return nullptr;
+  }
+
+  slot = getLeastRecentlyUsedSlot();
+  if (slots[slot].page != NO_PAGE) {
+    pageSlots[slots[slot].page] = NO_SLOT;
+  }
+
+  if (!load(page, slot)) {
+    slots[slot] = {NO_PAGE, 0};
+    return nullptr;
+  }
+
+  slots[slot] = {uint16_t(page), useCounter};
+  pageSlots[page] = slot;
+  return getSlotData(slot);
+}
+
+uint8_t GlyphPageCache::getLeastRecentlyUsedSlot() const
+{
+  uint8_t result = 0;
+  for (uint8_t slot = 1; slot < slotsCount; slot++) {
+    if (slots[slot].lastUse < slots[result].lastUse) {
+      result = slot;
+    }
+  }
+  return result;
+}
+
+bool GlyphPageCache::load(uint16_t page, uint8_t slot)
+{
+  coord_t height = specs[0];
+  coord_t width = getPageWidth(page);
+  uint32_t offset = page * sizeof(BitmapData) + (specs[page * GLYPH_PAGE_SIZE + 1] - specs[1]) * height;
+  uint32_t size = sizeof(BitmapData) + width * height;
+
+  auto data = getSlotData(slot);
+  if (!file.seek(offset) || file.read((uint8_t *)data, size) != size) {
+    TRACE("GlyphPageCache::load(%d) failed: read error", page);
+    return false;
+  }
+
+  if (data->width() != width || data->height() != height) {
+    TRACE("GlyphPageCache::load(%d) failed: wrong page size", page);
+    return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) OpenTX
+ *
+ * Source:
+ *  https://github.com/opentx/libopenui
+ *
+ * This file is a part of libopenui library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+
+#pragma once
+
+#include <cstdlib>
+#include <cstring>
+#include "bitmapdata.h"
+#include "libopenui_types.h"
+#include "libopenui_config.h"
+#include "file_reader.h"
+
+constexpr unsigned GLYPH_PAGE_SIZE = 16;
+
+// Glyphs of a font loaded from a file on first use, for the fonts with
+// thousands of CJK glyphs which can't all be resident. The specs table stays
+// in memory, the glyph strip is cut in pages of GLYPH_PAGE_SIZE glyphs, each
+// one stored in the file as a BitmapData mask of the font height. As the
+// offsets follow from the specs, page p starts at
+// 4 * p + (specs[1 + p * GLYPH_PAGE_SIZE] - specs[1]) * height.
+// The pages are kept in a fixed number of slots allocated once, and evicted
+// in LRU order.
+class GlyphPageCache
+{
+  public:
+    GlyphPageCache(const char * path, const uint16_t * specs, uint16_t count, uint8_t slotsCount = 8);
+
+    ~GlyphPageCache();
+
+    // Returns the page holding the glyph index, x being set to the glyph
+    // position in the page, or nullptr when the page can't be read
+    const BitmapData * getPage(unsigned index, coord_t & x);
+
+    [[nodiscard]] bool isLoaded(unsigned index) const
+    {
+      unsigned page = index / GLYPH_PAGE_SIZE;
+      return page < pagesCount && pageSlots[page] != NO_SLOT;
+    }
+
+    [[nodiscard]] uint32_t getBufferSize() const
+    {
+      return slotsCount * slotSize;
+    }
+
+    [[nodiscard]] uint32_t getHits() const
+    {
+      return hits;
+    }
+
+    [[nodiscard]] uint32_t getMisses() const
+    {
+      return misses;
+    }
+
+    void resetCounters()
+    {
+      hits = 0;
+      misses = 0;
+    }
+
+  protected:
+    static constexpr uint8_t NO_SLOT = 0xFF;
+    static constexpr uint16_t NO_PAGE = 0xFFFF;
+
+    struct Slot
+    {
+      uint16_t page;
+      uint32_t lastUse;
+    };
+
+    FileReaderBase file;
+    const uint16_t * specs;
+    uint16_t count;
+    uint16_t pagesCount;
+    uint8_t slotsCount;
+    uint32_t slotSize = 0;
+    uint8_t * buffer = nullptr;
+    Slot * slots = nullptr;
+    uint8_t * pageSlots = nullptr; // slot of each page, NO_SLOT when not loaded
+    uint32_t useCounter = 0;
+    uint32_t hits = 0;
+    uint32_t misses = 0;
+
+    [[nodiscard]] coord_t getPageWidth(unsigned page) const
+    {
+      unsigned last = min<unsigned>((page + 1) * GLYPH_PAGE_SIZE, count);
+      return specs[last + 1] - specs[page * GLYPH_PAGE_SIZE + 1];
+    }
+
+    [[nodiscard]] BitmapData * getSlotData(uint8_t slot) const
+    {
+      return (BitmapData *)(buffer + slot * slotSize);
+    }
+
+    uint8_t getLeastRecentlyUsedSlot() const;
+
+    bool load(uint16_t page, uint8_t slot);
+};
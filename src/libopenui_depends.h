@@ -26,6 +26,24 @@ void lcdNextLayer();
 void DMACopyBitmap(uint16_t * dest, int destw, int desth, int x, int y, const uint16_t * src, int srcw, int srch, int srcx, int srcy, int w, int h);
 void DMACopyAlphaBitmap(uint16_t * dest, bool destAlpha, int destw, int desth, int x, int y, const uint16_t * src, bool srcAlpha, int srcw, int srch, int srcx, int srcy, int w, int h);
 void DMACopyAlphaMask(uint16_t * dest, bool destAlpha, int destw, int desth, int x, int y, const uint8_t * src, int srcw, int srch, int srcx, int srcy, int w, int h, uint16_t color);
+// One mask rectangle of a DMACopyAlphaMasks() batch
+struct DMAMaskRect
+{
+  int16_t x;
+  int16_t y;
+  int16_t srcx;
+  int16_t srcy;
+  int16_t w;
+  int16_t h;
+};
+
+// Optional, only called when DMA_COPY_ALPHA_MASKS is defined, the rects are
+// drawn one by one with DMACopyAlphaMask() otherwise
+void DMACopyAlphaMasks(uint16_t * dest, bool destAlpha, int destw, int desth, const uint8_t * src, int srcw, int srch, const DMAMaskRect * rects, int count, uint16_t color);
+// Optional, only called when DMA_COPY_ALPHA_MASK4 is defined, the 4 bits
+// masks are unpacked by tiles drawn with DMACopyAlphaMask() otherwise
+void DMACopyAlphaMask4(uint16_t * dest, bool destAlpha, int destw, int desth, int x, int y, const uint8_t * src, int srcw, int srch, int srcx, int srcy, int w, int h, uint16_t color);
+void DMAFillRect(uint16_t * dest, int destw, int desth, int x, int y, int w, int h, uint16_t color);
 void onKeyPress();
 void onKeyError();
 void killEvents(event_t event);
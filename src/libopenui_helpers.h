@@ -63,6 +63,19 @@ inline int multDivRoundClosest(int v, int n, int d)
     return divRoundClosest(v * n, d);
 }
 
+// Largest integer whose square is <= n
+inline int isqrt(int n)
+{
+  if (n <= 0)
+    return 0;
+  int result = sqrtf(n);
+  while (result * result > n)
+    result--;
+  while ((result + 1) * (result + 1) <= n)
+    result++;
+  return result;
+}
+
 inline int mod(int k, int n)
 {
   return ((k %= n) < 0) ? k + n : k;
@@ -141,17 +141,22 @@ void MenuBody::paint(BitmapBuffer * dc)
     }
     else {
       const char * text = line.text.data();
+      if (text[0] == '\0') {
+        text = "---";
+      }
       if (IS_TRANSLATION_RIGHT_TO_LEFT()) {
-        dc->drawText(width() - MENUS_HORIZONTAL_PADDING, i * MENUS_LINE_HEIGHT + (MENUS_LINE_HEIGHT - getFontHeight(MENU_FONT)) / 2, text[0] == '\0' ? "---" : text, color, MENU_FONT | RIGHT);
+        line.layout.update(text, MENU_FONT | RIGHT);
+        dc->drawTextLayout(width() - MENUS_HORIZONTAL_PADDING, i * MENUS_LINE_HEIGHT + (MENUS_LINE_HEIGHT - getFontHeight(MENU_FONT)) / 2, line.layout, color);
       }
       else {
         if (line.icon) {
           dc->drawMask(MENUS_HORIZONTAL_PADDING, i * MENUS_LINE_HEIGHT + (MENUS_LINE_HEIGHT - line.icon->height()) / 2, line.icon, iconColor);
         }
+        line.layout.update(text, MENU_FONT);
         if (displayIcons)
-          dc->drawText(MENUS_HORIZONTAL_PADDING + MENUS_ICON_WIDTH, i * MENUS_LINE_HEIGHT + (MENUS_LINE_HEIGHT - getFontHeight(MENU_FONT)) / 2, text[0] == '\0' ? "---" : text, color, MENU_FONT);
+          dc->drawTextLayout(MENUS_HORIZONTAL_PADDING + MENUS_ICON_WIDTH, i * MENUS_LINE_HEIGHT + (MENUS_LINE_HEIGHT - getFontHeight(MENU_FONT)) / 2, line.layout, color);
         else
-          dc->drawText(MENUS_HORIZONTAL_PADDING, i * MENUS_LINE_HEIGHT + (MENUS_LINE_HEIGHT - getFontHeight(MENU_FONT)) / 2, text[0] == '\0' ? "---" : text, color, MENU_FONT);
+          dc->drawTextLayout(MENUS_HORIZONTAL_PADDING, i * MENUS_LINE_HEIGHT + (MENUS_LINE_HEIGHT - getFontHeight(MENU_FONT)) / 2, line.layout, color);
       }
     }
 
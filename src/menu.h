@@ -24,6 +24,7 @@
 #include <utility>
 #include "modal_window.h"
 #include "form.h"
+#include "textlayout.h"
 
 constexpr coord_t MENUS_HORIZONTAL_PADDING = 10;
 
@@ -65,6 +66,7 @@ class MenuBody: public Window
 
     protected:
       std::string text;
+      TextLayout layout;
       const BitmapMask * icon;
       std::function<void(BitmapBuffer * dc, coord_t x, coord_t y, LcdFlags flags)> drawLine;
       std::function<void()> onPress;
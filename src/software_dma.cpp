@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) OpenTX
+ *
+ * Source:
+ *  https://github.com/opentx/libopenui
+ *
+ * This file is a part of libopenui library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+// Reference implementation of the DMA* hooks for the simulator and the
+// targets without a DMA2D, enabled with the SOFTWARE_DMA cmake option
+
+#include <utility>
+#include "libopenui_types.h"
+#include "libopenui_depends.h"
+#include "blit_kernels.h"
+
+// Rectangles are given in display coordinates, they are converted here to the
+// memory layout given by PixelLayout::lcd(), stride being the pixels of a
+// memory line
+static void toStorage([[maybe_unused]] int bufferWidth, [[maybe_unused]] int bufferHeight, [[maybe_unused]] int & x, [[maybe_unused]] int & y, [[maybe_unused]] int & w, [[maybe_unused]] int & h, int & stride)
+{
+#if LCD_ORIENTATION == 180
+  x = bufferWidth - x - w;
+  y = bufferHeight - y - h;
+  stride = bufferWidth;
+#elif LCD_ORIENTATION == 270
+  std::swap(x, y);
+  std::swap(w, h);
+  stride = bufferHeight;
+#else
+  stride = bufferWidth;
+#endif
+}
+
+template <class T>
+struct StorageRect
+{
+  T * data;
+  int stride;
+  int w;
+  int h;
+
+  StorageRect(T * buffer, int bufferWidth, int bufferHeight, int x, int y, int w, int h):
+    w(w),
+    h(h)
+  {
+    toStorage(bufferWidth, bufferHeight, x, y, this->w, this->h, stride);
+#if LCD_ORIENTATION == 270 && defined(LTDC_OFFSET_X)
+    if (isLcdFrameBuffer(buffer)) {
+      stride += LTDC_OFFSET_X;
+      x += LTDC_OFFSET_X;
+    }
+#endif
+    data = buffer + y * stride + x;
+  }
+};
+
+void DMAFillRect(uint16_t * dest, int destw, int desth, int x, int y, int w, int h, uint16_t color)
+{
+  StorageRect<uint16_t> p(dest, destw, desth, x, y, w, h);
+  for (int line = 0; line < p.h; line++) {
+    blitFillSpan(p.data + line * p.stride, p.w, color);
+  }
+}
+
+void DMACopyBitmap(uint16_t * dest, int destw, int desth, int x, int y, const uint16_t * src, int srcw, int srch, int srcx, int srcy, int w, int h)
+{
+  StorageRect<uint16_t> p(dest, destw, desth, x, y, w, h);
+  StorageRect<const uint16_t> q(src, srcw, srch, srcx, srcy, w, h);
+  for (int line = 0; line < p.h; line++) {
+    blitCopySpan(p.data + line * p.stride, q.data + line * q.stride, p.w);
+  }
+}
+
+void DMACopyAlphaBitmap(uint16_t * dest, bool destAlpha, int destw, int desth, int x, int y, const uint16_t * src, bool srcAlpha, int srcw, int srch, int srcx, int srcy, int w, int h)
+{
+  StorageRect<uint16_t> p(dest, destw, desth, x, y, w, h);
+  StorageRect<const uint16_t> q(src, srcw, srch, srcx, srcy, w, h);
+  for (int line = 0; line < p.h; line++) {
+    blitAlphaBitmapSpan(p.data + line * p.stride, destAlpha, q.data + line * q.stride, srcAlpha, p.w);
+  }
+}
+
+void DMACopyAlphaMask(uint16_t * dest, bool destAlpha, int destw, int desth, int x, int y, const uint8_t * src, int srcw, int srch, int srcx, int srcy, int w, int h, uint16_t color)
+{
+  StorageRect<uint16_t> p(dest, destw, desth, x, y, w, h);
+  StorageRect<const uint8_t> q(src, srcw, srch, srcx, srcy, w, h);
+  for (int line = 0; line < p.h; line++) {
+    blitAlphaMaskSpan(p.data + line * p.stride, destAlpha, q.data + line * q.stride, p.w, color);
+  }
+}
+
+void DMACopyAlphaMasks(uint16_t * dest, bool destAlpha, int destw, int desth, const uint8_t * src, int srcw, int srch, const DMAMaskRect * rects, int count, uint16_t color)
+{
+  for (int i = 0; i < count; i++) {
+    auto & rect = rects[i];
+    DMACopyAlphaMask(dest, destAlpha, destw, desth, rect.x, rect.y, src, srcw, srch, rect.srcx, rect.srcy, rect.w, rect.h, color);
+  }
+}
+
+// The mask has 2 pixels per byte, each memory line starting on a new byte
+void DMACopyAlphaMask4(uint16_t * dest, bool destAlpha, int destw, int desth, int x, int y, const uint8_t * src, int srcw, int srch, int srcx, int srcy, int w, int h, uint16_t color)
+{
+  StorageRect<uint16_t> p(dest, destw, desth, x, y, w, h);
+  int stride;
+  toStorage(srcw, srch, srcx, srcy, w, h, stride);
+  int lineSize = (stride + 1) / 2;
+  for (int line = 0; line < p.h; line++) {
+    blitAlphaMask4Span(p.data + line * p.stride, destAlpha, src + (srcy + line) * lineSize + srcx / 2, srcx & 1, p.w, color);
+  }
+}
@@ -24,6 +24,18 @@ using namespace ui;
 
 coord_t StaticText::drawText(BitmapBuffer * dc, const rect_t & rect, const std::string & text, LcdColor textColor, LcdFlags textFlags)
 {
+  // the lines are laid out whatever their length, there is no window here to
+  // keep the layout from one call to the next
+  TextLayout layout;
+  layout.setMaxWidth(0, false);
+  layout.update(text.c_str(), textFlags);
+  return drawText(dc, rect, layout, textColor);
+}
+
+coord_t StaticText::drawText(BitmapBuffer * dc, const rect_t & rect, const TextLayout & layout, LcdColor textColor)
+{
+  auto textFlags = layout.getFlags();
+
   coord_t x = rect.x;
   if (textFlags & CENTERED)
     x += rect.w / 2;
@@ -36,21 +48,23 @@ coord_t StaticText::drawText(BitmapBuffer * dc, const rect_t & rect, const std::
   if (textFlags & VCENTERED) {
     y += (rect.h - fontHeight) / 2;
   }
-  
-  auto start = text.c_str();
-  auto current = start;
-  auto nextline = findNextLine(start);
-  if (nextline) {
-    do {
-      dc->drawText(x, y, text.substr(current - start, nextline - current).c_str(), textColor, textFlags);
-      current = nextline + 1;
-      nextline = findNextLine(current);
-      y += fontHeight + STATIC_TEXT_INTERLINE_HEIGHT;
-    } while (nextline);
+
+  dc->drawTextLayout(x, y, layout, textColor, STATIC_TEXT_INTERLINE_HEIGHT);
+  return y + layout.getLinesCount() * (fontHeight + STATIC_TEXT_INTERLINE_HEIGHT);
+}
+
+void StaticText::updateLayout() const
+{
+  if (wordWrap) {
+    // with an ellipsis the text is cut to the lines fitting in the window
+    auto fontHeight = getFontHeight(textFlags);
+    auto maxLines = ellipsis ? max<coord_t>(1, (rect.h - verticalPadding * 2 + STATIC_TEXT_INTERLINE_HEIGHT) / (fontHeight + STATIC_TEXT_INTERLINE_HEIGHT)) : 0;
+    layout.setMaxWidth(rect.w - horizontalPadding * 2, true, ellipsis, maxLines);
+  }
+  else {
+    layout.setMaxWidth(ellipsis ? rect.w - horizontalPadding * 2 : 0, false, ellipsis);
   }
-  dc->drawText(x, y, current, textColor, textFlags);
-  y += fontHeight + STATIC_TEXT_INTERLINE_HEIGHT;
-  return y;
+  layout.update(text.c_str(), textFlags);
 }
 
 void StaticText::paint(BitmapBuffer * dc)
@@ -59,5 +73,6 @@ void StaticText::paint(BitmapBuffer * dc)
     dc->drawPlainFilledRectangle(0, 0, rect.w, rect.h, bgColor);
   }
 
-  drawText(dc, {horizontalPadding, verticalPadding, rect.w - horizontalPadding * 2, rect.h - verticalPadding * 2}, text, textColor, textFlags);
+  updateLayout();
+  drawText(dc, {horizontalPadding, verticalPadding, rect.w - horizontalPadding * 2, rect.h - verticalPadding * 2}, layout, textColor);
 }
@@ -20,6 +20,7 @@
 #pragma once
 
 #include "window.h"
+#include "textlayout.h"
 #include "button.h" // TODO just for BUTTON_BACKGROUND
 
 constexpr coord_t STATIC_TEXT_INTERLINE_HEIGHT = 2;
@@ -48,21 +49,39 @@ class StaticText: public Window
 
     static coord_t drawText(BitmapBuffer * dc, const rect_t & rect, const std::string & text, LcdColor textColor, LcdFlags textFlags = 0);
 
+    static coord_t drawText(BitmapBuffer * dc, const rect_t & rect, const TextLayout & layout, LcdColor textColor);
+
     void paint(BitmapBuffer * dc) override;
 
     void setText(std::string value)
     {
       if (text != value) {
         text = std::move(value);
+        layout.invalidate();
         invalidate();
       }
     }
 
     coord_t getContentHeight() const
     {
+      if (wordWrap) {
+        updateLayout();
+        return layout.getLinesCount() * (getFontHeight(textFlags) + STATIC_TEXT_INTERLINE_HEIGHT);
+      }
       return getTextLinesCount(text.c_str()) * (getFontHeight(textFlags) + 2);
     }
 
+    // Wraps the lines at the spaces to fit in the window width, and / or
+    // ends the text with an ellipsis where it is cut
+    void setTextOverflow(bool wrap, bool ellipsis = false)
+    {
+      if (wrap != wordWrap || ellipsis != this->ellipsis) {
+        wordWrap = wrap;
+        this->ellipsis = ellipsis;
+        invalidate();
+      }
+    }
+
     void setBackgroundColor(LcdColor color)
     {
       bgColor = color;
@@ -91,10 +110,15 @@ class StaticText: public Window
 
   protected:
     std::string text;
+    mutable TextLayout layout; // the cache of the text layout
     LcdColor bgColor = 0;
     LcdColor textColor = DEFAULT_COLOR;
     coord_t horizontalPadding = 0;
     coord_t verticalPadding = 0;
+    bool wordWrap = false;
+    bool ellipsis = false;
+
+    void updateLayout() const;
 };
 
 class FormStaticText: public StaticText
@@ -178,6 +202,12 @@ class StaticBitmap: public Window
       invalidate();
     }
 
+    void setScaleFilter(BitmapFilter value)
+    {
+      filter = value;
+      invalidate();
+    }
+
 #if defined(DEBUG_WINDOWS)
     [[nodiscard]] std::string getName() const override
     {
@@ -192,7 +222,7 @@ class StaticBitmap: public Window
       }
       else if (bitmap) {
         if (scale)
-          dc->drawScaledBitmap(bitmap, 0, 0, width(), height());
+          dc->drawScaledBitmap(bitmap, 0, 0, width(), height(), filter);
         else
           dc->drawBitmap((width() - bitmap->width()) / 2, (height() - bitmap->height()) / 2, bitmap);
       }
@@ -203,6 +233,7 @@ class StaticBitmap: public Window
     const BitmapBuffer * bitmap = nullptr;
     LcdFlags color = 0;
     bool scale = false;
+    BitmapFilter filter = BMP_FILTER_NEAREST;
 };
 
 class DynamicText: public StaticText
@@ -217,11 +248,7 @@ class DynamicText: public StaticText
     void checkEvents() override
     {
       StaticText::checkEvents();
-      std::string newText = textHandler();
-      if (newText != text) {
-        text = newText;
-        invalidate();
-      }
+      setText(textHandler());
     }
 
     void setTextHandler(std::function<std::string()> handler)
@@ -264,8 +291,8 @@ class DynamicNumber: public Window
     {
       T newValue = numberHandler();
       if (value != newValue) {
+        invalidateDigits(newValue);
         value = newValue;
-        invalidate();
       }
     }
 
@@ -274,6 +301,48 @@ class DynamicNumber: public Window
     std::function<T()> numberHandler;
     const char * prefix;
     const char * suffix;
+
+    // When the number keeps its width, only the digits cells which changed
+    // are repainted
+    void invalidateDigits(T newValue)
+    {
+      char before[NUMBER_BUFFER_SIZE];
+      char after[NUMBER_BUFFER_SIZE];
+      int length = formatNumber(before, sizeof(before), value, textFlags, prefix, suffix);
+      if (formatNumber(after, sizeof(after), newValue, textFlags, prefix, suffix) != length || (textFlags & VERTICAL) || hasChineseChars(after)) {
+        invalidate();
+        return;
+      }
+
+      coord_t numberWidth = getNumberWidth(newValue, textFlags, prefix, suffix);
+      if (getNumberWidth(value, textFlags, prefix, suffix) != numberWidth) {
+        invalidate();
+        return;
+      }
+
+      int first = 0;
+      while (first < length && before[first] == after[first]) {
+        first++;
+      }
+      if (first == length) {
+        return;
+      }
+      int last = length - 1;
+      while (before[last] == after[last]) {
+        last--;
+      }
+
+      coord_t x = 0;
+      if (textFlags & RIGHT)
+        x = width() - numberWidth;
+      else if (textFlags & CENTERED)
+        x = -numberWidth / 2;
+
+      auto font = getFont(textFlags);
+      coord_t left = x + (first > 0 ? font->getTextWidth(after, first) : 0);
+      coord_t right = x + font->getTextWidth(after, last + 1);
+      invalidate({left, 0, right - left, height()});
+    }
 };
 
 }
@@ -24,6 +24,7 @@
 #include "form.h"
 #include "libopenui_config.h"
 #include "font.h"
+#include "textlayout.h"
 
 namespace ui {
 
@@ -52,7 +53,8 @@ class Table: public FormField
 
         void paint(BitmapBuffer * dc, const rect_t & rect, LcdColor color, LcdFlags flags) override
         {
-          dc->drawText(rect.x, rect.y + (rect.h - getFontHeight(TABLE_BODY_FONT)) / 2, value.c_str(), color, flags);
+          layout.update(value.c_str(), flags);
+          dc->drawTextLayout(rect.x, rect.y + (rect.h - getFontHeight(TABLE_BODY_FONT)) / 2, layout, color);
         }
 
         [[nodiscard]] bool needsInvalidate() override
@@ -68,11 +70,13 @@ class Table: public FormField
         void setValue(std::string newValue)
         {
           value = std::move(newValue);
+          layout.invalidate();
           valueChanged = true;
         }
 
       protected:
         std::string value;
+        TextLayout layout;
         bool valueChanged = false;
     };
 
@@ -89,6 +93,7 @@ class Table: public FormField
           auto newText = getText();
           if (newText != value) {
             value = newText;
+            layout.invalidate();
             return true;
           }
           else {
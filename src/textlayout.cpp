@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) OpenTX
+ *
+ * Source:
+ *  https://github.com/opentx/libopenui
+ *
+ * This file is a part of libopenui library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+
+#include "textlayout.h"
+
+bool TextLayout::update(const char * s, LcdFlags flags, uint8_t len)
+{
+  // the string is hashed each time, so that a text changed without
+  // invalidate() is never drawn with the layout of the previous one
+  auto font = ::getFont(flags);
+  uint16_t length;
+  auto hash = getHash(s, len, length);
+  if (valid && font == this->font && flags == this->flags && hash == this->hash && length == this->length) {
+    return false;
+  }
+
+  valid = true;
+
+  this->font = font;
+  this->flags = flags;
+  this->hash = hash;
+  this->length = length;
+  layout(s, len);
+  return true;
+}
+
+// FNV-1a of the chars drawSizedText() would draw
+uint32_t TextLayout::getHash(const char * s, uint8_t len, uint16_t & length)
+{
+  uint32_t result = 2166136261u;
+  length = 0;
+  for (int i = 0; (len == 0 || i < len) && s[i]; i++) {
+    result = (result ^ uint8_t(s[i])) * 16777619u;
+    length++;
+  }
+  return result;
+}
+
+void TextLayout::setMaxWidth(coord_t width, bool wrap, bool ellipsis, uint16_t maxLines)
+{
+  if (width != maxWidth || wrap != this->wrap || ellipsis != this->ellipsis || maxLines != this->maxLines) {
+    maxWidth = width;
+    this->wrap = wrap;
+    this->ellipsis = ellipsis;
+    this->maxLines = maxLines;
+    // the key doesn't match any text anymore
+    font = nullptr;
+    valid = false;
+  }
+}
+
+void TextLayout::addLine(Line & line, coord_t lineWidth, unsigned end)
+{
+  line.count = end - line.first;
+  line.width = lineWidth;
+  lines.push_back(line);
+  width = max(width, lineWidth);
+  line = {uint16_t(end), 0, 0};
+}
+
+// Replaces the end of the line with "..." so that it fits in maxWidth
+void TextLayout::addEllipsis(Line & line, coord_t & pos)
+{
+  auto dot = font->getChar('.');
+  coord_t dotWidth = dot.width + CHAR_SPACING;
+
+  while (items.size() > line.first) {
+    auto & last = items.back();
+    pos = last.pos + last.glyph.width + CHAR_SPACING;
+    if (pos + 3 * dotWidth - CHAR_SPACING <= maxWidth)
+      break;
+    items.pop_back();
+    pos = 0;
+  }
+
+  for (int i = 0; i < 3; i++) {
+    items.push_back({dot, pos});
+    pos += dotWidth;
+  }
+}
+
+// The same steps as drawSizedText(), the spaces being only used for the
+// positions
+void TextLayout::layout(const char * s, uint8_t len)
+{
+  items.clear();
+  lines.clear();
+  width = 0;
+
+  Line line = {0, 0, 0};
+  coord_t pos = 0;
+  bool skipLine = false;
+
+  // the last space of the line, where it may be wrapped
+  int breakItem = -1;  // none when < line.first
+  coord_t breakWidth = 0;
+  coord_t breakPos = 0;
+
+  for (int i = 0; len == 0 || i < len; ++i, ++s) {
+    unsigned int c = uint8_t(*s);
+
+    if (!c) {
+      break;
+    }
+    else if (c == '\n') {
+      if (maxLines && lines.size() + 1 >= maxLines && s[1] && (len == 0 || i + 1 < len)) {
+        // the following lines are cut
+        if (ellipsis)
+          addEllipsis(line, pos);
+        break;
+      }
+      addLine(line, pos, items.size());
+      pos = 0;
+      skipLine = false;
+      breakItem = -1;
+      continue;
+    }
+    else if (skipLine || c < 0x20) {
+      if (c >= CJK_BYTE1_MIN)
+        ++s;
+      continue;
+    }
+
+    Font::Glyph glyph;
+    coord_t advance;
+    if (c >= CJK_BYTE1_MIN) {
+      glyph = font->getCJKChar(c, *++s);
+      advance = glyph.width + CHAR_SPACING;
+    }
+    else {
+      glyph = font->getChar(c);
+      if (c >= '0' && c <= '9')
+        advance = font->getChar('9').width + CHAR_SPACING;
+      else
+        advance = glyph.width + CHAR_SPACING;
+    }
+
+    if (c == ' ') {
+      breakItem = items.size();
+      breakWidth = pos;
+      pos += advance;
+      breakPos = pos;
+      continue;
+    }
+
+    if (maxWidth && pos + glyph.width > maxWidth && items.size() > line.first) {
+      if (wrap && !(maxLines && lines.size() + 1 >= maxLines)) {
+        if (breakItem > int(line.first)) {
+          // the glyphs after the space start the next line
+          addLine(line, breakWidth, breakItem);
+          for (auto it = items.begin() + breakItem; it != items.end(); ++it) {
+            it->pos -= breakPos;
+          }
+          pos -= breakPos;
+        }
+        else {
+          addLine(line, pos, items.size());
+          pos = 0;
+        }
+        breakItem = -1;
+      }
+      else {
+        if (ellipsis)
+          addEllipsis(line, pos);
+        if (wrap)
+          break;
+        skipLine = true;
+        continue;
+      }
+    }
+
+    if (glyph.width) {
+      items.push_back({glyph, pos});
+    }
+    pos += advance;
+  }
+
+  addLine(line, pos, items.size());
+}
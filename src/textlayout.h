@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) OpenTX
+ *
+ * Source:
+ *  https://github.com/opentx/libopenui
+ *
+ * This file is a part of libopenui library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+
+#pragma once
+
+#include <vector>
+#include "font.h"
+
+// Glyphs and line breaks of a string laid out once with the font given by its
+// flags. Widgets which draw the same string on each repaint keep one, and only
+// lay the string out again when their text changes: update() hashes the
+// string and keeps the layout while the key (string hash and length, font,
+// flags) is the same, invalidate() forces the next update() to lay it out.
+// The lines may be wrapped at the spaces to fit in a width, and the text cut
+// with an ellipsis when it doesn't fit. The string is read in place and the
+// vectors keep their capacity, so laying out a text of the same size again
+// doesn't allocate.
+class TextLayout
+{
+  public:
+    struct Item
+    {
+      Font::Glyph glyph;
+      coord_t pos; // from the start of the line
+    };
+
+    struct Line
+    {
+      uint16_t first;
+      uint16_t count;
+      coord_t width;
+    };
+
+    // Returns true when the text had to be laid out again
+    bool update(const char * s, LcdFlags flags, uint8_t len = 0);
+
+    // Limits the lines to width (0 for no limit). Too long lines are wrapped
+    // at their last space (or at any glyph when they have none) when wrap is
+    // set, or cut otherwise. The text is cut after maxLines lines (0 for no
+    // limit). An ellipsis ends the cut lines when ellipsis is set
+    void setMaxWidth(coord_t width, bool wrap = true, bool ellipsis = false, uint16_t maxLines = 0);
+
+    void invalidate()
+    {
+      valid = false;
+    }
+
+    [[nodiscard]] bool isValid() const
+    {
+      return valid;
+    }
+
+    [[nodiscard]] const Font * getFont() const
+    {
+      return font;
+    }
+
+    [[nodiscard]] LcdFlags getFlags() const
+    {
+      return flags;
+    }
+
+    // The width of the widest line, as given by Font::getTextWidth()
+    [[nodiscard]] coord_t getWidth() const
+    {
+      return width;
+    }
+
+    [[nodiscard]] unsigned getLinesCount() const
+    {
+      return lines.size();
+    }
+
+    [[nodiscard]] const Line & getLine(unsigned index) const
+    {
+      return lines[index];
+    }
+
+    [[nodiscard]] const Item & getItem(unsigned index) const
+    {
+      return items[index];
+    }
+
+  protected:
+    std::vector<Item> items;
+    std::vector<Line> lines;
+    const Font * font = nullptr;
+    LcdFlags flags = 0;
+    uint32_t hash = 0;
+    uint16_t length = 0;
+    coord_t width = 0;
+    coord_t maxWidth = 0;
+    uint16_t maxLines = 0;
+    bool wrap = false;
+    bool ellipsis = false;
+    bool valid = false;
+
+    static uint32_t getHash(const char * s, uint8_t len, uint16_t & length);
+
+    void layout(const char * s, uint8_t len);
+
+    // Ends the line before the item end
+    void addLine(Line & line, coord_t width, unsigned end);
+
+    void addEllipsis(Line & line, coord_t & pos);
+};
@@ -0,0 +1,221 @@
+/*
+ * Copyright (C) OpenTX
+ *
+ * Source:
+ *  https://github.com/opentx/libopenui
+ *
+ * This file is a part of libopenui library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+
+#include "truetypefont.h"
+#include "file_reader.h"
+
+TrueTypeFace::TrueTypeFace(const uint8_t * data)
+{
+  int offset = stbtt_GetFontOffsetForIndex(data, 0);
+  valid = offset >= 0 && stbtt_InitFont(&info, data, offset);
+}
+
+TrueTypeFace * TrueTypeFace::load(const char * path)
+{
+  FileReaderBase reader(path);
+  if (!reader.size()) {
+    return nullptr;
+  }
+
+  auto data = (uint8_t *)malloc(reader.size());
+  if (!data) {
+    TRACE("TrueTypeFace::load(%s) failed: not enough memory", path);
+    return nullptr;
+  }
+
+  if (reader.read(data, reader.size()) != reader.size()) {
+    TRACE("TrueTypeFace::load(%s) failed: read error", path);
+    free(data);
+    return nullptr;
+  }
+
+  auto face = new TrueTypeFace(data);
+  face->ownedData = data;
+  if (!face->isValid()) {
+    TRACE("TrueTypeFace::load(%s) failed: wrong format", path);
+    delete face;
+    return nullptr;
+  }
+
+  return face;
+}
+
+GlyphAtlas::GlyphAtlas(TrueTypeFace * face, coord_t pixelHeight, uint16_t count, coord_t atlasWidth, coord_t atlasHeight, const uint32_t * codepoints):
+  face(face),
+  count(count)
+{
+  auto info = face->getInfo();
+  scale = stbtt_ScaleForPixelHeight(info, pixelHeight);
+  int ascent, descent, lineGap;
+  stbtt_GetFontVMetrics(info, &ascent, &descent, &lineGap);
+  baseline = lroundf(ascent * scale);
+
+  specs = (uint16_t *)malloc((count + 2) * sizeof(uint16_t));
+  glyphs = (uint16_t *)malloc(count * sizeof(uint16_t));
+  cells = (Cell *)malloc(count * sizeof(Cell));
+  nodes = (stbrp_node *)malloc(atlasWidth * sizeof(stbrp_node));
+  atlas = BitmapMask::allocate(BMP_RGB565, atlasWidth, atlasHeight);
+  if (!specs || !glyphs || !cells || !nodes || !atlas) {
+    TRACE("GlyphAtlas() failed: not enough memory");
+    this->count = 0;
+    return;
+  }
+
+  // the specs widths are the advances, the offsets only being used for them
+  specs[0] = pixelHeight;
+  specs[1] = 0;
+  for (unsigned index = 0; index < count; index++) {
+    int glyph = stbtt_FindGlyphIndex(info, codepoints ? codepoints[index] : 0x20 + index);
+    int advance, leftSideBearing;
+    stbtt_GetGlyphHMetrics(info, glyph, &advance, &leftSideBearing);
+    glyphs[index] = glyph;
+    specs[index + 2] = specs[index + 1] + min<int>(lroundf(advance * scale), 255);
+  }
+
+  clear();
+}
+
+GlyphAtlas::~GlyphAtlas()
+{
+  free(specs);
+  free(glyphs);
+  free(cells);
+  free(nodes);
+  delete atlas;
+}
+
+void GlyphAtlas::clear()
+{
+  if (!atlas) {
+    return;
+  }
+
+  for (unsigned index = 0; index < count; index++) {
+    cells[index] = {NOT_RENDERED, 0, 0, 0, 0, 0};
+  }
+  stbrp_init_target(&packer, atlas->width(), atlas->height(), nodes, atlas->width());
+  memset(atlas->getData(), 0, atlas->getDataSize());
+}
+
+const BitmapMask * GlyphAtlas::getGlyph(unsigned index, Cell & cell)
+{
+  if (index >= count) {
+    return nullptr;
+  }
+
+  if (cells[index].x == NOT_RENDERED) {
+    misses++;
+    if (!render(index)) {
+      return nullptr;
+    }
+  }
+  else {
+    hits++;
+  }
+
+  if (cells[index].x == EMPTY) {
+    return nullptr;
+  }
+
+  cell = cells[index];
+  return atlas;
+}
+
+GlyphAtlas::Cell GlyphAtlas::getBounds(unsigned index) const
+{
+  if (index >= count || cells[index].x == EMPTY) {
+    return {EMPTY, 0, 0, 0, 0, 0};
+  }
+
+  if (cells[index].x != NOT_RENDERED) {
+    return cells[index];
+  }
+
+  // the glyph box is relative to the pen position on the baseline
+  int x0, y0, x1, y1;
+  stbtt_GetGlyphBitmapBox(face->getInfo(), glyphs[index], scale, scale, &x0, &y0, &x1, &y1);
+  if (specs[index + 2] == specs[index + 1] || x1 <= x0 || y1 <= y0) {
+    return {EMPTY, 0, 0, 0, 0, 0};
+  }
+
+  return {NOT_RENDERED, 0, int16_t(x0), int16_t(baseline + y0), uint16_t(x1 - x0), uint16_t(y1 - y0)};
+}
+
+bool GlyphAtlas::render(unsigned index)
+{
+  auto cell = getBounds(index);
+  if (cell.width == 0) {
+    cells[index] = cell;
+    return true;
+  }
+
+  stbrp_rect rect{};
+  rect.w = stbrp_coord(cell.width);
+  rect.h = stbrp_coord(cell.height);
+  if (!stbrp_pack_rects(&packer, &rect, 1)) {
+    clear();
+    flushes++;
+    if (!stbrp_pack_rects(&packer, &rect, 1)) {
+      TRACE("GlyphAtlas::render(%d) failed: atlas too small", index);
+      return false;
+    }
+  }
+
+  // the glyph is rasterized row major, then copied to the layout of the atlas
+  auto box = (uint8_t *)malloc(cell.width * cell.height);
+  if (!box) {
+    return false;
+  }
+
+  stbtt_MakeGlyphBitmap(face->getInfo(), box, cell.width, cell.height, cell.width, scale, scale, glyphs[index]);
+
+  for (int j = 0; j < cell.height; j++) {
+    for (int i = 0; i < cell.width; i++) {
+      *atlas->getPixelPtrAbs(rect.x + i, rect.y + j) = box[j * cell.width + i];
+    }
+  }
+
+  free(box);
+  cell.x = rect.x;
+  cell.y = rect.y;
+  cells[index] = cell;
+  return true;
+}
+
+Font::Font(const char * name, GlyphAtlas * atlas):
+  name(name),
+  count(atlas->getCount()),
+  atlas(atlas),
+  specs(atlas->getSpecs())
+{
+}
+
+void * stb_malloc(unsigned int size);
+void stb_free(void * ptr);
+
+#define STBTT_malloc(x, u)                  ((void)(u), stb_malloc(x))
+#define STBTT_free(x, u)                    ((void)(u), stb_free(x))
+
+#pragma GCC diagnostic ignored "-Wsign-compare"
+#pragma GCC diagnostic ignored "-Wunused-but-set-variable"
+#define STB_TRUETYPE_IMPLEMENTATION
+#include "thirdparty/stb/stb_truetype.h"
+#define STB_RECT_PACK_IMPLEMENTATION
+#include "thirdparty/stb/stb_rect_pack.h"
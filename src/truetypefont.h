@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) OpenTX
+ *
+ * Source:
+ *  https://github.com/opentx/libopenui
+ *
+ * This file is a part of libopenui library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+
+#pragma once
+
+#include "bitmapbuffer.h"
+#include "thirdparty/stb/stb_truetype.h"
+#include "thirdparty/stb/stb_rect_pack.h"
+
+// TrueType font data, shared by the atlases of all the pixel sizes
+class TrueTypeFace
+{
+  public:
+    // data has to stay valid as long as the face
+    explicit TrueTypeFace(const uint8_t * data);
+
+    ~TrueTypeFace()
+    {
+      free(ownedData);
+    }
+
+    static TrueTypeFace * load(const char * path);
+
+    [[nodiscard]] bool isValid() const
+    {
+      return valid;
+    }
+
+    [[nodiscard]] const stbtt_fontinfo * getInfo() const
+    {
+      return &info;
+    }
+
+  protected:
+    stbtt_fontinfo info;
+    uint8_t * ownedData = nullptr;
+    bool valid;
+};
+
+// Glyphs of a TrueType face at one pixel height, rasterized on first use into
+// an A8 atlas packed with stb_rect_pack. Each glyph gets a cell of the size of
+// its bitmap box, placed from the pen position with its bearings, so that the
+// glyphs may start before the pen or overhang their advance. The advances are
+// computed once in a specs table with the same layout as the static fonts
+// ones. When the atlas is full it is cleared, the glyphs being rasterized
+// again on their next use.
+class GlyphAtlas
+{
+  public:
+    // codepoints gives the unicode of each glyph index, when nullptr the
+    // indexes are the ones of the static fonts (the first glyph is ' ')
+    GlyphAtlas(TrueTypeFace * face, coord_t pixelHeight, uint16_t count, coord_t atlasWidth, coord_t atlasHeight, const uint32_t * codepoints = nullptr);
+
+    ~GlyphAtlas();
+
+    [[nodiscard]] uint16_t getCount() const
+    {
+      return count;
+    }
+
+    [[nodiscard]] const uint16_t * getSpecs() const
+    {
+      return specs;
+    }
+
+    // Cell of a glyph: its rect in the atlas, and the offset of this rect
+    // from the pen position at the top of the line
+    struct Cell
+    {
+      uint16_t x;
+      uint16_t y;
+      int16_t left;
+      int16_t top;
+      uint16_t width;
+      uint16_t height;
+    };
+
+    // Returns the atlas with the glyph index rasterized in cell, or nullptr
+    // when the glyph has nothing to draw
+    const BitmapMask * getGlyph(unsigned index, Cell & cell);
+
+    // Returns the offset and the size of the glyph index cell, without
+    // rasterizing the glyph (the width is 0 when it has nothing to draw)
+    [[nodiscard]] Cell getBounds(unsigned index) const;
+
+    [[nodiscard]] bool isRendered(unsigned index) const
+    {
+      return index < count && cells[index].x != NOT_RENDERED;
+    }
+
+    [[nodiscard]] uint32_t getHits() const
+    {
+      return hits;
+    }
+
+    [[nodiscard]] uint32_t getMisses() const
+    {
+      return misses;
+    }
+
+    [[nodiscard]] uint32_t getFlushes() const
+    {
+      return flushes;
+    }
+
+    void resetCounters()
+    {
+      hits = 0;
+      misses = 0;
+      flushes = 0;
+    }
+
+    // Drops all the rasterized glyphs
+    void clear();
+
+  protected:
+    static constexpr uint16_t NOT_RENDERED = 0xFFFF;
+    static constexpr uint16_t EMPTY = 0xFFFE;
+
+    TrueTypeFace * face;
+    float scale;
+    coord_t baseline;
+    uint16_t count;
+    uint16_t * specs = nullptr;
+    uint16_t * glyphs = nullptr; // TrueType glyph of each index
+    Cell * cells = nullptr;
+    BitmapMask * atlas = nullptr;
+    stbrp_context packer;
+    stbrp_node * nodes = nullptr;
+    uint32_t hits = 0;
+    uint32_t misses = 0;
+    uint32_t flushes = 0;
+
+    bool render(unsigned index);
+};
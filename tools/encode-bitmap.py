@@ -4,7 +4,16 @@ import argparse
 from PIL import Image
 
 
-class RawMixin:
+class ByteMixin:
+    def encode_pixel(self, value, size):
+        for i in range(size):
+            self.encode_byte((value >> (8 * i)) & 255)
+
+    def encode_line_end(self):
+        self.f.write("\n")
+
+
+class RawMixin(ByteMixin):
     def encode_byte(self, byte):
         self.write(byte)
 
@@ -12,7 +21,7 @@ class RawMixin:
         pass
 
 
-class RleMixin:
+class RleMixin(ByteMixin):
     RLE_BYTE = 0
     RLE_SEQ = 1
 
@@ -52,6 +61,62 @@ class RleMixin:
             self.write(self.count)
 
 
+class PixelRleMixin:
+    # Each line is a list of packets: a header h, followed by one pixel
+    # repeated (h & 0x7F) + 1 times when h & 0x80, else by h + 1 pixels.
+    # An index of the line offsets comes first, so that lines can be skipped
+    MAX_PACKET = 128
+
+    def __init__(self):
+        self.lines = []
+        self.line = []
+        self.pixel_size = 1
+
+    def encode_pixel(self, value, size):
+        self.pixel_size = size
+        self.line.append(value)
+
+    def encode_line_end(self):
+        self.lines.append(self.encode_packets(self.line))
+        self.line = []
+
+    def encode_packets(self, pixels):
+        result = []
+        i = 0
+        while i < len(pixels):
+            run = 1
+            while i + run < len(pixels) and run < self.MAX_PACKET and pixels[i + run] == pixels[i]:
+                run += 1
+            if run > 1:
+                result.append(0x80 + run - 1)
+                result.extend(self.pixel_bytes(pixels[i]))
+                i += run
+            else:
+                count = 1
+                while i + count < len(pixels) and count < self.MAX_PACKET and (i + count + 1 >= len(pixels) or pixels[i + count + 1] != pixels[i + count]):
+                    count += 1
+                result.append(count - 1)
+                for pixel in pixels[i:i + count]:
+                    result.extend(self.pixel_bytes(pixel))
+                i += count
+        return result
+
+    def pixel_bytes(self, value):
+        return [(value >> (8 * i)) & 255 for i in range(self.pixel_size)]
+
+    def encode_end(self):
+        offset = 0
+        for line in self.lines:
+            for i in range(4):
+                self.write((offset >> (8 * i)) & 255)
+            offset += len(line)
+        self.f.write("\n")
+        for line in self.lines:
+            for value in line:
+                self.write(value)
+            self.f.write("\n")
+
+
 class ImageEncoder:
     def __init__(self, filename, size_format, orientation=0):
         self.f = open(filename, "w")
@@ -111,42 +176,89 @@ class ImageEncoder:
         image = image.convert(mode='L')
         width, height = image.size
         self.write_size(width, height)
-        if self.orientation == 270:
-            for x in range(width):
-                for y in range(height):
-                    value = 0xFF - self.get_pixel(image, x, y)
-                    self.encode_byte(value)
-                self.f.write("\n")
-        else:
-            for y in range(height):
-                for x in range(width):
-                    value = 0xFF - self.get_pixel(image, x, y)
-                    self.encode_byte(value)
-                self.f.write("\n")
+        for line in self.get_lines(width, height):
+            for x, y in line:
+                value = 0xFF - self.get_pixel(image, x, y)
+                self.encode_pixel(value, 1)
+            self.encode_line_end()
         self.encode_end()
 
+    def encode_alpha4(self, image):
+        # 2 pixels per byte, the low nibble first, each line starting on a new byte
+        image = image.convert(mode='L')
+        width, height = image.size
+        self.write_size(width, height)
+        for line in self.get_lines(width, height):
+            values = [(0xFF - self.get_pixel(image, x, y)) >> 4 for x, y in line]
+            values += [0] * (len(values) % 2)
+            for i in range(0, len(values), 2):
+                self.write(values[i] + (values[i + 1] << 4))
+            self.f.write("\n")
+
     def encode_5_6_5(self, image):
         width, height = image.size
         self.write_size(width, height)
-        for y in range(height):
-            for x in range(width):
+        for line in self.get_lines(width, height):
+            for x, y in line:
                 pixel = self.get_pixel(image, x, y)
                 val = ((pixel[0] >> 3) << 11) + ((pixel[1] >> 2) << 5) + ((pixel[2] >> 3) << 0)
-                self.encode_byte(val & 255)
-                self.encode_byte(val >> 8)
+                self.encode_pixel(val, 2)
+            self.encode_line_end()
         self.encode_end()
 
     def encode_4_4_4_4(self, image):
         width, height = image.size
         self.write_size(width, height)
-        for y in range(height):
-            for x in range(width):
+        for line in self.get_lines(width, height):
+            for x, y in line:
                 pixel = self.get_pixel(image, x, y)
                 val = ((pixel[3] // 16) << 12) + ((pixel[0] // 16) << 8) + ((pixel[1] // 16) << 4) + ((pixel[2] // 16) << 0)
-                self.encode_byte(val & 255)
-                self.encode_byte(val >> 8)
+                self.encode_pixel(val, 2)
+            self.encode_line_end()
         self.encode_end()
 
+    def encode_indexed(self, image, bits, palette_format):
+        # values of the palette formats, and the BitmapFormat enum of the library
+        if palette_format == "4/4/4/4":
+            image = image.convert(mode='RGBA')
+            convert = lambda pixel: ((pixel[3] // 16) << 12) + ((pixel[0] // 16) << 8) + ((pixel[1] // 16) << 4) + ((pixel[2] // 16) << 0)
+            palette_id = 1
+        else:
+            image = image.convert(mode='RGB')
+            convert = lambda pixel: ((pixel[0] >> 3) << 11) + ((pixel[1] >> 2) << 5) + ((pixel[2] >> 3) << 0)
+            palette_id = 0
+        width, height = image.size
+        lines = [[convert(self.get_pixel(image, x, y)) for x, y in line] for line in self.get_lines(width, height)]
+        palette = sorted(set(value for line in lines for value in line))
+        if len(palette) > (1 << bits):
+            raise ValueError("%d colors, the %d bits format allows %d" % (len(palette), bits, 1 << bits))
+        indexes = {value: index for index, value in enumerate(palette)}
+        self.write_size(width, height)
+        self.write(3 if bits == 4 else 2)
+        self.write(palette_id)
+        self.write(len(palette) & 255)
+        self.write(len(palette) >> 8)
+        for value in palette:
+            self.write(value & 255)
+            self.write(value >> 8)
+        self.f.write("\n")
+        for line in lines:
+            if bits == 4:
+                line = line + [line[-1]] * (len(line) % 2)
+                for i in range(0, len(line), 2):
+                    self.write(indexes[line[i]] + (indexes[line[i + 1]] << 4))
+            else:
+                for value in line:
+                    self.write(indexes[value])
+            self.f.write("\n")
+
+    def get_lines(self, width, height):
+        # the pixels in the order of the LCD layout, columns when it is rotated
+        if self.orientation == 270:
+            return [[(x, y) for y in range(height)] for x in range(width)]
+        else:
+            return [[(x, y) for x in range(width)] for y in range(height)]
+
     def get_pixel(self, image, x, y):
         if self.orientation == 180:
             return image.getpixel((image.width - x - 1, image.height - y - 1))
@@ -169,14 +281,32 @@ def main():
     parser.add_argument('--format', action="store", help="Output format")
     parser.add_argument("--orientation", action="store", type=int, help="LCD orientation")
     parser.add_argument("--rle", help="Enable RLE compression", action="store_true")
+    parser.add_argument("--pixel-rle", help="Enable pixel RLE compression with a line index (8bits, 4/4/4/4 and 5/6/5 formats)", action="store_true")
     parser.add_argument("--rows", help="Image rows count (for 1bit format)", type=int, default=1)
     parser.add_argument("--size-format", help="Header image size format (1 or 2 bytes)", type=int, default=1)
+    parser.add_argument("--palette-format", help="Palette format of the indexed formats (5/6/5 or 4/4/4/4)", default="5/6/5")
 
     args = parser.parse_args()
 
     image = Image.open(args.input)
     output = args.output
-    encoder = ImageEncoder.create(output, args.size_format, args.orientation, RleMixin if args.rle else RawMixin)
+    if args.format in ("indexed8", "indexed4", "alpha4"):
+        if args.rle or args.pixel_rle:
+            parser.error("the %s format is not compressed" % args.format)
+        if args.size_format != 2:
+            parser.error("the %s format needs --size-format 2" % args.format)
+
+    if args.pixel_rle:
+        if args.format not in ("8bits", "4/4/4/4", "5/6/5"):
+            parser.error("--pixel-rle is not supported with the %s format" % args.format)
+        if args.size_format != 2:
+            parser.error("--pixel-rle needs --size-format 2")
+        encode_mixin = PixelRleMixin
+    elif args.rle:
+        encode_mixin = RleMixin
+    else:
+        encode_mixin = RawMixin
+    encoder = ImageEncoder.create(output, args.size_format, args.orientation, encode_mixin)
 
     if args.format == "1bit":
         encoder.encode_1bit(image, args.rows)
@@ -186,8 +316,14 @@ def main():
         encoder.encode_8bits(image)
     elif args.format == "4/4/4/4":
         encoder.encode_4_4_4_4(image)
+    elif args.format == "alpha4":
+        encoder.encode_alpha4(image)
     elif args.format == "5/6/5":
         encoder.encode_5_6_5(image)
+    elif args.format == "indexed8":
+        encoder.encode_indexed(image, 8, args.palette_format)
+    elif args.format == "indexed4":
+        encoder.encode_indexed(image, 4, args.palette_format)
 
 
 if __name__ == "__main__":